@@ -0,0 +1,133 @@
+#!/bin/bash
+#
+# Benchmark driver for privconvert - run by `make bench`
+#
+# Generates a synthetic tree with bench/gentree on a scratch filesystem,
+# converts it to unprivileged and back with bench/privconvert-bench and
+# reports files/sec, syscalls/file, peak RSS and the time spent in each
+# phase (walk, stat, chown, chmod, acl) for both directions, taken from
+# the --stats=json report.
+#
+# Environment:
+#   BENCH_DIR     Scratch directory, must match the one the binary was built for
+#   BENCH_FS      tmpfs (default), ext4 (loop-mounted image) or zfs
+#   BENCH_SIZE    Size of the tmpfs or ext4 image (default: 4G)
+#   BENCH_POOL    ZFS pool to create the scratch dataset in (BENCH_FS=zfs)
+#   BENCH_ARGS    Extra privconvert options, e.g. "--jobs 8 --io-uring"
+#   BENCH_COLD    Set to 1 to drop caches before each conversion
+#
+# Arguments are passed to gentree, e.g. --depth 5 --fanout 6 --acls 10
+#
+
+set -e
+
+BENCH_DIR=${BENCH_DIR:-/tmp/privconvert-bench}
+BENCH_FS=${BENCH_FS:-tmpfs}
+BENCH_SIZE=${BENCH_SIZE:-4G}
+BENCH_CT=999999
+BIN_DIR=$(dirname "$0")
+ROOT="$BENCH_DIR/root"
+MOUNTED=""
+
+if [ "$(id -u)" -ne 0 ]; then
+    echo "ERROR: the benchmark must run as root"
+    exit 1
+fi
+for bin in gentree privconvert-bench; do
+    if [ ! -x "$BIN_DIR/$bin" ]; then
+        echo "ERROR: $BIN_DIR/$bin not built, run make bench"
+        exit 1
+    fi
+done
+
+cleanup() {
+    case "$MOUNTED" in
+        zfs) zfs destroy -r "$BENCH_POOL/privconvert-bench" ;;
+        mount) umount "$ROOT" ;;
+    esac
+    rm -rf "$BENCH_DIR"
+}
+trap cleanup EXIT
+
+mkdir -p "$BENCH_DIR/conf" "$BENCH_DIR/state" "$ROOT"
+case "$BENCH_FS" in
+    tmpfs)
+        mount -t tmpfs -o size="$BENCH_SIZE" privconvert-bench "$ROOT"
+        MOUNTED=mount
+        ;;
+    ext4)
+        truncate -s "$BENCH_SIZE" "$BENCH_DIR/ext4.img"
+        mkfs.ext4 -q -F "$BENCH_DIR/ext4.img"
+        mount -o loop "$BENCH_DIR/ext4.img" "$ROOT"
+        MOUNTED=mount
+        ;;
+    zfs)
+        if [ -z "$BENCH_POOL" ]; then
+            echo "ERROR: BENCH_FS=zfs needs BENCH_POOL"
+            exit 1
+        fi
+        zfs create -o mountpoint="$ROOT" -o acltype=posixacl -o xattr=sa \
+            "$BENCH_POOL/privconvert-bench"
+        MOUNTED=zfs
+        ;;
+    *)
+        echo "ERROR: unknown BENCH_FS $BENCH_FS"
+        exit 1
+        ;;
+esac
+
+echo "Generating tree on $BENCH_FS: $*"
+"$BIN_DIR/gentree" "$@" "$ROOT/rootfs"
+printf "rootfs: %s,size=8G\nunprivileged: 0\n" "$ROOT/rootfs" > "$BENCH_DIR/conf/$BENCH_CT.conf"
+
+# Run one conversion and print its result line and phase breakdown
+run() {
+    local target=$1
+    local log="$BENCH_DIR/$target.log"
+    local start end
+
+    if [ "$BENCH_COLD" = "1" ]; then
+        sync
+        echo 3 > /proc/sys/vm/drop_caches
+    fi
+    start=$(date +%s%N)
+    if ! "$BIN_DIR/privconvert-bench" --no-journal --stats=json -y $BENCH_ARGS \
+            "$BENCH_CT" "$target" > "$log" 2>&1; then
+        cat "$log" >&2
+        echo "ERROR: conversion to $target failed"
+        exit 1
+    fi
+    end=$(date +%s%N)
+
+    # Split the JSON line into one "key":value or op record per line
+    grep '^{"version"' "$log" | grep -o '"[a-z_0-9]*":\({"calls":[0-9]*,"ns":[0-9]*\|[0-9]*\)' |
+    awk -F'[":,{]+' -v target="$target" -v ns=$((end - start)) '
+        function phase(op) {
+            if (op == "open" || op == "getdents64") return "walk"
+            if (op == "stat" || op == "io_uring_enter") return "stat"
+            if (op == "getxattr" || op == "setxattr") return "acl"
+            return op
+        }
+        $2 == "files" && !files { files = $3; next }
+        $2 == "maxrss_kb" { rss = $3; next }
+        $3 == "calls" && $2 != "shift_acl" {
+            p = phase($2)
+            if (!(p in calls)) order[++n] = p
+            calls[p] += $4; time[p] += $6; total += $4
+        }
+        END {
+            secs = ns / 1e9
+            printf "%-13s %10d %9.3f %12.0f %11.2f %9.1f\n", target, files, secs,
+                   files / secs, files ? total / files : 0, rss / 1024
+            for (i = 1; i <= n; i++) {
+                p = order[i]
+                printf "  %-9s %12d calls %10.3f s %8.2f us/call\n", p, calls[p],
+                       time[p] / 1e9, calls[p] ? time[p] / calls[p] / 1e3 : 0
+            }
+        }'
+}
+
+echo
+printf "%-13s %10s %9s %12s %11s %9s\n" "TARGET" "FILES" "SECONDS" "FILES/S" "SYSCALLS/F" "RSS MiB"
+run unprivileged
+run privileged
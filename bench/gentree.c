@@ -0,0 +1,312 @@
+/*
+ * gentree - Generate a synthetic container tree for benchmarking privconvert
+ *
+ * The tree is a complete directory tree of the given depth and fan-out
+ * with a number of files per directory. A seeded generator picks, per
+ * file, whether it is a hardlink to an earlier file, a symlink, setuid,
+ * and whether it carries an ACL, so the same options always give the same
+ * tree. Ids are spread over a small set starting at --base, as in a
+ * privileged (base 0) or unprivileged (base 100000) rootfs.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/xattr.h>
+#include <endian.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#define ACL_XATTR_ACCESS "system.posix_acl_access"
+#define ACL_XATTR_DEFAULT "system.posix_acl_default"
+#define ACL_XATTR_VERSION 0x0002
+#define ACL_USER_OBJ 0x01
+#define ACL_USER 0x02
+#define ACL_GROUP_OBJ 0x04
+#define ACL_GROUP 0x08
+#define ACL_MASK 0x10
+#define ACL_OTHER 0x20
+#define ACL_UNDEFINED_ID UINT32_MAX
+
+typedef struct {
+    int depth;
+    int fanout;
+    int files;
+    int hardlinks;      /* Percent of files that are links to an earlier one */
+    int symlinks;       /* Percent of files that are symlinks */
+    int acls;           /* Percent of files and directories with an ACL */
+    int setuid;         /* Percent of regular files that are setuid */
+    int ids;            /* Distinct uids and gids */
+    uint32_t base;
+    uint64_t seed;
+} gen_opts_t;
+
+typedef struct {
+    uint64_t dirs;
+    uint64_t files;
+    uint64_t hardlinks;
+    uint64_t symlinks;
+    uint64_t acls;
+    uint64_t setuid;
+    uint64_t errors;
+} gen_stats_t;
+
+typedef struct {
+    uint16_t e_tag;
+    uint16_t e_perm;
+    uint32_t e_id;
+} acl_xattr_entry_t;
+
+static gen_opts_t opts = { 4, 4, 100, 5, 2, 2, 1, 16, 0, 1 };
+static gen_stats_t stats;
+static uint64_t rng_state;
+
+/* xorshift64*, plenty for picking file kinds */
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static int rng_percent(int percent) {
+    return (int)(rng_next() % 100) < percent;
+}
+
+static uint32_t rng_id(void) {
+    return opts.base + (uint32_t)(rng_next() % opts.ids);
+}
+
+/* Give an entry an ACL naming one extra user and group */
+static int set_acl(int dirfd, const char *name, const char *xattr) {
+    struct {
+        uint32_t version;
+        acl_xattr_entry_t entries[6];
+    } acl;
+    static const uint16_t tags[6] = {
+        ACL_USER_OBJ, ACL_USER, ACL_GROUP_OBJ, ACL_GROUP, ACL_MASK, ACL_OTHER
+    };
+    int fd;
+    int ret;
+    
+    acl.version = htole32(ACL_XATTR_VERSION);
+    for (int i = 0; i < 6; i++) {
+        int named = tags[i] == ACL_USER || tags[i] == ACL_GROUP;
+        acl.entries[i].e_tag = htole16(tags[i]);
+        acl.entries[i].e_perm = htole16(tags[i] == ACL_USER_OBJ ? 6 : 4);
+        acl.entries[i].e_id = htole32(named ? rng_id() : ACL_UNDEFINED_ID);
+    }
+    
+    fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    ret = fsetxattr(fd, xattr, &acl, sizeof(acl), 0);
+    close(fd);
+    return ret;
+}
+
+static void gen_error(const char *what, const char *name) {
+    if (stats.errors++ == 0) {
+        fprintf(stderr, "gentree: %s %s: %s\n", what, name, strerror(errno));
+    }
+}
+
+static void gen_dir(int dirfd, int level) {
+    char name[32], prev[32] = "";
+    
+    for (int i = 0; i < opts.files; i++) {
+        uint32_t uid = rng_id(), gid = rng_id();
+        
+        snprintf(name, sizeof(name), "f%d", i);
+        if (prev[0] && rng_percent(opts.hardlinks)) {
+            if (linkat(dirfd, prev, dirfd, name, 0) == -1) {
+                gen_error("linking", name);
+            }
+            stats.hardlinks++;
+            continue;
+        }
+        if (rng_percent(opts.symlinks)) {
+            if (symlinkat(prev[0] ? prev : "..", dirfd, name) == -1 ||
+                fchownat(dirfd, name, uid, gid, AT_SYMLINK_NOFOLLOW) == -1) {
+                gen_error("creating symlink", name);
+            }
+            stats.symlinks++;
+            continue;
+        }
+        
+        int fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            gen_error("creating", name);
+            continue;
+        }
+        if (fchown(fd, uid, gid) == -1) {
+            gen_error("chown", name);
+        }
+        if (rng_percent(opts.setuid)) {
+            if (fchmod(fd, 04755) == -1) {
+                gen_error("chmod", name);
+            }
+            stats.setuid++;
+        }
+        close(fd);
+        if (rng_percent(opts.acls)) {
+            if (set_acl(dirfd, name, ACL_XATTR_ACCESS) == -1) {
+                gen_error("setting ACL on", name);
+            }
+            stats.acls++;
+        }
+        stats.files++;
+        memcpy(prev, name, sizeof(prev));
+    }
+    
+    if (level >= opts.depth) {
+        return;
+    }
+    for (int i = 0; i < opts.fanout; i++) {
+        int fd;
+        
+        snprintf(name, sizeof(name), "d%d", i);
+        if (mkdirat(dirfd, name, 0755) == -1 ||
+            fchownat(dirfd, name, rng_id(), rng_id(), AT_SYMLINK_NOFOLLOW) == -1) {
+            gen_error("creating directory", name);
+            continue;
+        }
+        if (rng_percent(opts.acls)) {
+            if (set_acl(dirfd, name, ACL_XATTR_ACCESS) == -1 ||
+                set_acl(dirfd, name, ACL_XATTR_DEFAULT) == -1) {
+                gen_error("setting ACL on", name);
+            }
+            stats.acls++;
+        }
+        stats.dirs++;
+        
+        fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd == -1) {
+            gen_error("opening", name);
+            continue;
+        }
+        gen_dir(fd, level + 1);
+        close(fd);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options] <directory>\n", prog);
+    fprintf(stderr, "\nOptions (default):\n");
+    fprintf(stderr, "  --depth N      Directory levels below the root (4)\n");
+    fprintf(stderr, "  --fanout N     Subdirectories per directory (4)\n");
+    fprintf(stderr, "  --files N      Files per directory (100)\n");
+    fprintf(stderr, "  --hardlinks P  Percent of files that are extra links (5)\n");
+    fprintf(stderr, "  --symlinks P   Percent of files that are symlinks (2)\n");
+    fprintf(stderr, "  --acls P       Percent of entries with an ACL (2)\n");
+    fprintf(stderr, "  --setuid P     Percent of files that are setuid (1)\n");
+    fprintf(stderr, "  --ids N        Distinct uids and gids (16)\n");
+    fprintf(stderr, "  --base ID      First id, 100000 for an unprivileged tree (0)\n");
+    fprintf(stderr, "  --seed N       Generator seed (1)\n");
+    exit(1);
+}
+
+static int parse_int(const char *arg, int min, int max, const char *prog) {
+    char *end;
+    long v = strtol(arg, &end, 10);
+    
+    if (*arg == '\0' || *end != '\0' || v < min || v > max) {
+        fprintf(stderr, "Error: %s must be between %d and %d\n", arg, min, max);
+        usage(prog);
+    }
+    return (int)v;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    int fd;
+    static const struct option long_options[] = {
+        {"depth",     required_argument, NULL, 'd'},
+        {"fanout",    required_argument, NULL, 'F'},
+        {"files",     required_argument, NULL, 'f'},
+        {"hardlinks", required_argument, NULL, 'H'},
+        {"symlinks",  required_argument, NULL, 'S'},
+        {"acls",      required_argument, NULL, 'A'},
+        {"setuid",    required_argument, NULL, 'U'},
+        {"ids",       required_argument, NULL, 'i'},
+        {"base",      required_argument, NULL, 'b'},
+        {"seed",      required_argument, NULL, 's'},
+        {"help",      no_argument,       NULL, 'h'},
+        {NULL,        0,                 NULL, 0}
+    };
+    
+    while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            opts.depth = parse_int(optarg, 0, 64, argv[0]);
+            break;
+        case 'F':
+            opts.fanout = parse_int(optarg, 0, 10000, argv[0]);
+            break;
+        case 'f':
+            opts.files = parse_int(optarg, 0, 1000000, argv[0]);
+            break;
+        case 'H':
+            opts.hardlinks = parse_int(optarg, 0, 100, argv[0]);
+            break;
+        case 'S':
+            opts.symlinks = parse_int(optarg, 0, 100, argv[0]);
+            break;
+        case 'A':
+            opts.acls = parse_int(optarg, 0, 100, argv[0]);
+            break;
+        case 'U':
+            opts.setuid = parse_int(optarg, 0, 100, argv[0]);
+            break;
+        case 'i':
+            opts.ids = parse_int(optarg, 1, 65536, argv[0]);
+            break;
+        case 'b':
+            opts.base = (uint32_t)parse_int(optarg, 0, 100000000, argv[0]);
+            break;
+        case 's':
+            opts.seed = (uint64_t)parse_int(optarg, 0, 0x7fffffff, argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1) {
+        usage(argv[0]);
+    }
+    
+    /* Zero is a fixed point of xorshift */
+    rng_state = opts.seed * 0x9E3779B97F4A7C15ULL + 1;
+    
+    if (mkdir(argv[optind], 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Error creating %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+    fd = open(argv[optind], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1 || fchown(fd, opts.base, opts.base) == -1) {
+        fprintf(stderr, "Error opening %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+    stats.dirs = 1;
+    gen_dir(fd, 0);
+    close(fd);
+    
+    printf("dirs %"PRIu64" files %"PRIu64" hardlinks %"PRIu64" symlinks %"PRIu64
+           " acls %"PRIu64" setuid %"PRIu64"\n", stats.dirs, stats.files, stats.hardlinks,
+           stats.symlinks, stats.acls, stats.setuid);
+    if (stats.errors > 0) {
+        fprintf(stderr, "gentree: %"PRIu64" errors\n", stats.errors);
+        return 1;
+    }
+    return 0;
+}
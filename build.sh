@@ -18,44 +18,15 @@ fi
 
 echo "✓ GCC found: $(gcc --version | head -n1)"
 
-# Check for libacl headers
-if [ ! -f /usr/include/sys/acl.h ] && [ ! -f /usr/local/include/sys/acl.h ]; then
-    echo
-    echo "ERROR: libacl development files not found"
-    echo
-    echo "To install on Debian/Ubuntu:"
-    echo "  sudo apt install libacl1-dev"
+# Try a static build first, fall back to dynamic linking
+echo
+echo "Building static version..."
+if ! make; then
     echo
-    echo "To install on RHEL/CentOS/Fedora:"
-    echo "  sudo dnf install libacl-devel"
-    echo "  or"
-    echo "  sudo yum install libacl-devel"
+    echo "⚠ Warning: Static build failed (static libc missing?)"
+    echo "  Building dynamic version instead."
     echo
-    exit 1
-fi
-
-echo "✓ libacl development files found"
-
-# Check for static libraries (warn if not found)
-STATIC_LIB_FOUND=0
-for path in /usr/lib /usr/lib64 /usr/lib/x86_64-linux-gnu /usr/local/lib /usr/local/lib64; do
-    if [ -f "$path/libacl.a" ]; then
-        STATIC_LIB_FOUND=1
-        echo "✓ Static libacl found: $path/libacl.a"
-        break
-    fi
-done
-
-if [ $STATIC_LIB_FOUND -eq 0 ]; then
-    echo "⚠ Warning: Static libacl.a not found"
-    echo "  Static build may fail. Building dynamic version instead."
-    echo
-    echo "Building dynamic version..."
     make dynamic
-else
-    echo
-    echo "Building static version..."
-    make
 fi
 
 echo
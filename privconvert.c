@@ -16,554 +16,6366 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <dirent.h>
-#include <errno.h>
 #include <ftw.h>
-#include <sys/acl.h>
-#include <acl/libacl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/xattr.h>
+#include <endian.h>
 #include <ctype.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <time.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/mman.h>
+#include <sys/statvfs.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <linux/io_uring.h>
+#include <linux/mount.h>
 
-#define MAX_PATHS 64
 #define MAX_LINE 4096
 #define MAX_PATH_LEN 2048
 #define UID_GID_OFFSET 100000
 #define MAX_UID_GID 200000
+#define MAX_JOBS 256
+#define MAX_BATCH_RANGES 256
+#ifndef LXC_CONFIG_DIR
+#define LXC_CONFIG_DIR "/etc/pve/lxc"
+#endif
+#define ROOTFS_IDMAP_OPTION "idmap=container"
+#ifndef JOURNAL_DIR
+#define JOURNAL_DIR "/var/lib/privconvert"
+#endif
+#define REPORT_LIMIT 20                /* Out of range entries listed per path */
+#define REPORT_RING 64                 /* Messages a walker thread can have queued */
+#define REPORT_REPEAT 5                /* Messages printed per kind, the rest are counted */
+#define REPORT_KINDS 64                /* Kinds of messages told apart */
+#define DENTS_BUF_SIZE (1024 * 1024)   /* getdents64 buffer per walker thread */
+#define PREFETCH_QUEUE 256             /* Directories waiting to be prefetched */
+#define PREFETCH_BUF_SIZE (64 * 1024)  /* getdents64 buffer per prefetch thread */
+#define MAX_PREFETCH 64
+#define WALK_MAX_QUEUE 262144          /* Queued directories in memory, more spill to disk */
+#define SPILL_DIR "/var/tmp"           /* Unlinked spill file, not on tmpfs */
+#define PROC_FD_MIN_DEPTH 8            /* Shorter paths resolve faster than /proc/self/fd */
+#define ACL_XATTR_ACCESS "system.posix_acl_access"
+#define ACL_XATTR_DEFAULT "system.posix_acl_default"
+#define ACL_XATTR_BUF_SIZE 8192        /* Stack buffer, about 1000 ACL entries */
+#define URING_BATCH 64                 /* statx requests per io_uring submission */
+#define STAT_MASK (STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID | STATX_INO)
 
-/* Global variables for nftw callback */
-static int g_offset = 0;
-static uint64_t g_files_processed = 0;
-static uint64_t g_errors = 0;
+/* Global conversion state, shared by all walker threads */
+static int g_jobs = 0;                 /* walker threads, 0 = one per CPU */
+static int g_per_device = 1;           /* Paths converted at once on one device */
+static int g_proc_fd = 0;              /* /proc/self/fd is available */
+static int g_io_uring = 0;             /* Batch entry stats through io_uring */
+static int g_journal = 1;              /* Keep a resume journal per container */
+static int g_idempotent = 0;           /* Skip converted entries instead of stopping */
+static int g_zfs_clone = 0;            /* Convert ZFS clones, swap them in at the end */
+static int g_idmap_mount = 0;          /* Idmap the rootfs instead of converting it */
+static int g_nested = 0;               /* Also convert filesystems mounted below the paths */
+static int g_dry_run = 0;              /* Take a census, change nothing */
+static int g_prefetch = 0;             /* Threads warming metadata ahead of the walk */
+static long g_max_open = 0;            /* Directories kept open, 0 = half the fd limit */
+static long g_max_queue = WALK_MAX_QUEUE; /* Queued directories kept in memory */
+static double g_verify = 0;            /* Percent of directories verified afterwards */
+static uint64_t g_verify_seed = 0;     /* Picks the sampled directories of this run */
 
-/* Hash table for tracking processed inodes */
-#define INODE_HASH_SIZE 65536
-typedef struct inode_entry {
-    dev_t dev;
-    ino_t ino;
-    struct inode_entry *next;
-} inode_entry_t;
+/*
+ * Instrumentation for --stats=json. Every walker thread counts its
+ * syscalls by type, with the cumulative time and a log2 latency histogram,
+ * in its own slot of g_thread_stats; slot 0 is the main thread. With stats
+ * off t_stats stays NULL and STATS_CALL costs one thread-local load.
+ */
+#define STATS_OPEN 0        /* Opening directories */
+#define STATS_GETDENTS 1
+#define STATS_STAT 2        /* statx, or fstatat on old kernels */
+#define STATS_URING 3       /* io_uring_enter for batched statx */
+#define STATS_CHOWN 4
+#define STATS_CHMOD 5
+#define STATS_GETXATTR 6
+#define STATS_SETXATTR 7
+#define STATS_SHIFT_ACL 8   /* Whole shift_acl() calls, xattr I/O included */
+#define STATS_HANDLE 9      /* name_to_handle_at for the change log */
+#define STATS_OPS 10
+#define STATS_HIST_BUCKETS 32          /* Bucket i: [2^i, 2^(i+1)) ns, last one open */
 
-static inode_entry_t *inode_table[INODE_HASH_SIZE] = {NULL};
+typedef struct {
+    uint64_t calls[STATS_OPS];
+    uint64_t ns[STATS_OPS];
+    uint64_t hist[STATS_OPS][STATS_HIST_BUCKETS];
+} __attribute__((aligned(64))) thread_stats_t;
 
-/* Hash function for inode tracking */
-static unsigned int inode_hash(dev_t dev, ino_t ino) {
-    return (unsigned int)((dev ^ ino) % INODE_HASH_SIZE);
+static const char *const stats_names[STATS_OPS] = {
+    "open", "getdents64", "stat", "io_uring_enter", "chown", "chmod",
+    "getxattr", "setxattr", "shift_acl", "name_to_handle_at"
+};
+static int g_stats = 0;                /* Print a JSON report at the end */
+static thread_stats_t g_thread_stats[MAX_JOBS + 1];
+static __thread thread_stats_t *t_stats;
+
+static uint64_t stats_now(void) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
 }
 
-/* Check if inode has been seen */
-static int inode_seen(dev_t dev, ino_t ino) {
-    unsigned int hash = inode_hash(dev, ino);
-    inode_entry_t *entry = inode_table[hash];
+static void stats_add(int op, uint64_t start) {
+    uint64_t ns = stats_now() - start;
+    int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
     
-    while (entry) {
-        if (entry->dev == dev && entry->ino == ino) {
-            return 1;
+    t_stats->calls[op]++;
+    t_stats->ns[op] += ns;
+    t_stats->hist[op][bucket < STATS_HIST_BUCKETS ? bucket : STATS_HIST_BUCKETS - 1]++;
+}
+
+#define STATS_CALL(op, call) __extension__ ({ \
+        uint64_t stats_start_ = t_stats ? stats_now() : 0; \
+        __typeof__(call) stats_ret_ = (call); \
+        if (stats_start_) { \
+            stats_add(op, stats_start_); \
+        } \
+        stats_ret_; \
+    })
+
+/*
+ * Throttling for shared pools. A token bucket caps the entries converted
+ * per second (each costs three to four metadata syscalls) across all walker
+ * threads; workers take tokens in batches so the bucket lock is not taken
+ * per entry, and a worker that overdraws the bucket sleeps off its debt.
+ * With a latency target the rate adapts: every THROTTLE_INTERVAL_NS the
+ * mean latency of the metadata syscalls counted by the instrumentation is
+ * compared with the target, the rate is halved when it is above and grows
+ * by a tenth while it is below, until the cap or no limit is reached.
+ */
+#define THROTTLE_BATCH 32              /* Most tokens a worker takes at once */
+#define THROTTLE_INTERVAL_NS 250000000ull
+#define THROTTLE_MIN_SAMPLES 16        /* Syscalls needed to judge an interval */
+#define THROTTLE_MIN_RATE 50.0         /* Entries per second the controller keeps */
+
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+typedef struct {
+    pthread_mutex_t lock;
+    double max_rate;            /* --max-rate, 0 = none */
+    double max_latency_ns;      /* --max-latency, 0 = none */
+    double rate;                /* Current rate, 0 = unlimited */
+    double tokens;              /* Negative while workers sleep off a debt */
+    uint64_t last_ns;           /* Last refill */
+    uint64_t interval_ns;       /* Start of the controller interval */
+    uint64_t interval_calls;    /* Latency counters at its start */
+    uint64_t interval_time;
+    uint64_t interval_entries;
+    uint64_t entries;           /* Tokens handed out */
+    uint64_t wait_ns;           /* Time workers were told to sleep */
+    double min_rate;            /* Lowest rate set, 0 if never limited */
+} throttle_t;
+
+static int g_throttle = 0;             /* Rate cap or latency target set */
+static int g_background = 0;           /* Idle I/O class and nice 19 for walkers */
+static throttle_t throttle = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Calls and nanoseconds of the metadata syscalls so far, read while threads count */
+static void throttle_latency(uint64_t *calls, uint64_t *ns) {
+    static const int ops[] = { STATS_OPEN, STATS_STAT, STATS_CHOWN, STATS_CHMOD,
+                               STATS_GETXATTR, STATS_SETXATTR };
+    
+    *calls = 0;
+    *ns = 0;
+    for (int t = 0; t <= MAX_JOBS; t++) {
+        for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+            *calls += __atomic_load_n(&g_thread_stats[t].calls[ops[i]], __ATOMIC_RELAXED);
+            *ns += __atomic_load_n(&g_thread_stats[t].ns[ops[i]], __ATOMIC_RELAXED);
         }
-        entry = entry->next;
     }
-    return 0;
 }
 
-/* Mark inode as seen */
-static void inode_mark_seen(dev_t dev, ino_t ino) {
-    unsigned int hash = inode_hash(dev, ino);
-    inode_entry_t *entry = malloc(sizeof(inode_entry_t));
-    if (!entry) {
-        fprintf(stderr, "Failed to allocate memory for inode tracking\n");
-        return;
+/* Start a new controller interval, or a walk when first is set */
+static void throttle_reset(throttle_t *t, uint64_t now, int first) {
+    if (first) {
+        t->rate = t->max_rate;
+        t->tokens = 0;
+        t->last_ns = now;
+        t->min_rate = t->max_rate;
     }
-    entry->dev = dev;
-    entry->ino = ino;
-    entry->next = inode_table[hash];
-    inode_table[hash] = entry;
+    t->interval_ns = now;
+    t->interval_entries = t->entries;
+    throttle_latency(&t->interval_calls, &t->interval_time);
 }
 
-/* Free inode table */
-static void free_inode_table(void) {
-    for (int i = 0; i < INODE_HASH_SIZE; i++) {
-        inode_entry_t *entry = inode_table[i];
-        while (entry) {
-            inode_entry_t *next = entry->next;
-            free(entry);
-            entry = next;
+/* AIMD step of the latency controller, called with the lock held */
+static void throttle_adapt(throttle_t *t, uint64_t now) {
+    uint64_t calls, ns;
+    double mean, observed;
+    
+    throttle_latency(&calls, &ns);
+    if (calls - t->interval_calls < THROTTLE_MIN_SAMPLES) {
+        return; /* Keep collecting */
+    }
+    mean = (double)(ns - t->interval_time) / (calls - t->interval_calls);
+    observed = (t->entries - t->interval_entries) * 1e9 / (now - t->interval_ns);
+    
+    if (mean > t->max_latency_ns) {
+        t->rate = (t->rate > 0 ? t->rate : observed) / 2;
+        if (t->rate < THROTTLE_MIN_RATE) {
+            t->rate = THROTTLE_MIN_RATE;
+        }
+        if (t->min_rate == 0 || t->rate < t->min_rate) {
+            t->min_rate = t->rate;
+        }
+    } else if (t->rate > 0) {
+        t->rate += t->rate / 10;
+        if (t->max_rate > 0 && t->rate >= t->max_rate) {
+            t->rate = t->max_rate;
+        } else if (t->max_rate == 0 && t->rate > 2 * observed) {
+            t->rate = 0; /* The bucket no longer holds anything back */
         }
-        inode_table[i] = NULL;
     }
+    throttle_reset(t, now, 0);
 }
 
-/* Shift ACL entries */
-static int shift_acl(const char *path, acl_type_t type, int offset) {
-    acl_t acl;
-    acl_entry_t entry;
-    int entry_id;
-    int needs_update = 0;
+/* Take one token for an entry, sleeping when the bucket is overdrawn */
+static void throttle_take(int *credit) {
+    throttle_t *t = &throttle;
+    uint64_t now, wait = 0;
+    int batch = THROTTLE_BATCH;
     
-    acl = acl_get_file(path, type);
-    if (!acl) {
-        if (errno == ENOTSUP || errno == ENOSYS) {
-            /* ACLs not supported on this filesystem */
-            return 0;
-        }
-        return -1;
+    if (!g_throttle) {
+        return;
+    }
+    if (*credit > 0) {
+        (*credit)--;
+        return;
     }
     
-    /* Iterate through ACL entries */
-    entry_id = ACL_FIRST_ENTRY;
-    while (acl_get_entry(acl, entry_id, &entry) == 1) {
-        entry_id = ACL_NEXT_ENTRY;
-        acl_tag_t tag;
+    pthread_mutex_lock(&t->lock);
+    now = stats_now();
+    if (t->max_latency_ns > 0 && now - t->interval_ns >= THROTTLE_INTERVAL_NS) {
+        throttle_adapt(t, now);
+    }
+    if (t->rate > 0) {
+        double burst = t->rate / 10 > THROTTLE_BATCH ? t->rate / 10 : THROTTLE_BATCH;
         
-        if (acl_get_tag_type(entry, &tag) == -1) {
-            acl_free(acl);
-            return -1;
+        /* Small batches at low rates, so sleeps stay short and even */
+        if (t->rate / 100 < batch) {
+            batch = t->rate / 100 > 1 ? (int)(t->rate / 100) : 1;
         }
-        
-        /* Only shift USER and GROUP entries */
-        if (tag == ACL_USER || tag == ACL_GROUP) {
-            void *qualifier = acl_get_qualifier(entry);
-            if (qualifier) {
-                uid_t *id = (uid_t *)qualifier;
-                uid_t old_id = *id;
-                uid_t new_id;
-                
-                /* Validate new ID - handle unsigned arithmetic carefully */
-                if (offset < 0) {
-                    if (old_id < (uid_t)(-offset)) {
-                        fprintf(stderr, "Error: UID/GID would become negative\n");
-                        acl_free(qualifier);
-                        acl_free(acl);
-                        return -1;
-                    }
-                    new_id = old_id - (uid_t)(-offset);
-                } else {
-                    new_id = old_id + (uid_t)offset;
-                    if (new_id > MAX_UID_GID) {
-                        fprintf(stderr, "Error: UID/GID would exceed %d\n", MAX_UID_GID);
-                        acl_free(qualifier);
-                        acl_free(acl);
-                        return -1;
-                    }
-                }
-                
-                *id = new_id;
-                if (acl_set_qualifier(entry, id) == -1) {
-                    acl_free(qualifier);
-                    acl_free(acl);
-                    return -1;
-                }
-                needs_update = 1;
-                acl_free(qualifier);
-            }
+        t->tokens += (now - t->last_ns) * t->rate / 1e9;
+        if (t->tokens > burst) {
+            t->tokens = burst;
         }
+        t->tokens -= batch;
+        if (t->tokens < 0) {
+            wait = (uint64_t)(-t->tokens * 1e9 / t->rate);
+        }
+    } else {
+        t->tokens = 0;
     }
+    t->last_ns = now;
+    t->entries += batch;
+    t->wait_ns += wait;
+    pthread_mutex_unlock(&t->lock);
     
-    /* Apply updated ACL if needed */
-    if (needs_update) {
-        if (acl_set_file(path, type, acl) == -1) {
-            acl_free(acl);
-            return -1;
+    *credit = batch - 1;
+    if (wait > 0) {
+        struct timespec ts = { (time_t)(wait / 1000000000u), (long)(wait % 1000000000u) };
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
         }
     }
+}
+
+/* Lower the calling thread's I/O and CPU priority for --background */
+static void background_thread(void) {
+    static int warned = 0;
+    int ret;
     
-    acl_free(acl);
-    return 0;
+    ret = syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                  IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+    if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19) == -1) {
+        ret = -1;
+    }
+    if (ret == -1 && !__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED)) {
+        fprintf(stderr, "Warning: could not lower thread priority: %s\n", strerror(errno));
+    }
 }
 
-/* Process a single file/directory */
-static int process_file(const char *fpath, const struct stat *sb,
-                       int typeflag, struct FTW *ftwbuf) {
-    (void)sb;       /* Unused - we call lstat ourselves */
-    (void)typeflag; /* Unused - we check file type via stat */
-    (void)ftwbuf;   /* Unused - we don't need traversal info */
-    struct stat st;
-    uid_t new_uid;
-    gid_t new_gid;
+/*
+ * Arena allocator
+ *
+ * Memory is carved from large chunks with a bump pointer and only given
+ * back to the system all at once, so the hot path never calls malloc()
+ * and teardown costs one free() per chunk. A slab layer on top keeps
+ * per-size-class free lists so short-lived blocks are reused. Neither
+ * is thread-safe, every walker thread owns its own.
+ */
+#define ARENA_CHUNK_SIZE (1024 * 1024)
+#define ARENA_ALIGN 16
+#define SLAB_MIN_SHIFT 5                /* Smallest class: 32 bytes */
+#define SLAB_CLASSES 8                  /* Largest class: 4 KiB */
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t used;
+    size_t size;
+    char data[] __attribute__((aligned(ARENA_ALIGN)));
+} arena_chunk_t;
+
+typedef struct {
+    arena_chunk_t *chunks;
+} arena_t;
+
+typedef struct slab_block {
+    struct slab_block *next;
+} slab_block_t;
+
+typedef struct {
+    arena_t arena;
+    slab_block_t *free_list[SLAB_CLASSES];
+} slab_t;
+
+static void *arena_alloc(arena_t *arena, size_t size) {
+    arena_chunk_t *chunk = arena->chunks;
     
-    /* Get file stats without following symlinks */
-    if (lstat(fpath, &st) == -1) {
-        fprintf(stderr, "Error stating %s: %s\n", fpath, strerror(errno));
-        g_errors++;
-        return 0; /* Continue traversal */
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (!chunk || chunk->size - chunk->used < size) {
+        /* Oversized requests get a chunk of their own behind the current one */
+        size_t chunk_size = size > ARENA_CHUNK_SIZE / 4 ? size : ARENA_CHUNK_SIZE;
+        arena_chunk_t *fresh = malloc(sizeof(arena_chunk_t) + chunk_size);
+        if (!fresh) {
+            return NULL;
+        }
+        fresh->used = 0;
+        fresh->size = chunk_size;
+        if (chunk && chunk_size != ARENA_CHUNK_SIZE) {
+            fresh->next = chunk->next;
+            chunk->next = fresh;
+        } else {
+            fresh->next = chunk;
+            arena->chunks = fresh;
+        }
+        chunk = fresh;
+    }
+    
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+/* Release everything allocated from an arena */
+static void arena_release(arena_t *arena) {
+    arena_chunk_t *chunk = arena->chunks;
+    
+    while (chunk) {
+        arena_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->chunks = NULL;
+}
+
+/* Size class for a block, SLAB_CLASSES for blocks that are not recycled */
+static int slab_class(size_t size) {
+    int cls = 0;
+    
+    while (cls < SLAB_CLASSES && ((size_t)1 << (cls + SLAB_MIN_SHIFT)) < size) {
+        cls++;
+    }
+    return cls;
+}
+
+static void *slab_alloc(slab_t *slab, size_t size) {
+    int cls = slab_class(size);
+    
+    if (cls == SLAB_CLASSES) {
+        return arena_alloc(&slab->arena, size);
     }
+    if (slab->free_list[cls]) {
+        slab_block_t *block = slab->free_list[cls];
+        slab->free_list[cls] = block->next;
+        return block;
+    }
+    return arena_alloc(&slab->arena, (size_t)1 << (cls + SLAB_MIN_SHIFT));
+}
+
+/* Return a block to a slab, which need not be the one it came from */
+static void slab_free(slab_t *slab, void *ptr, size_t size) {
+    int cls = slab_class(size);
     
-    /* Check if we've already processed this inode */
-    if (inode_seen(st.st_dev, st.st_ino)) {
-        return 0; /* Skip hardlinks we've already processed */
+    if (cls < SLAB_CLASSES) {
+        slab_block_t *block = ptr;
+        block->next = slab->free_list[cls];
+        slab->free_list[cls] = block;
+    }
+}
+
+static void slab_release(slab_t *slab) {
+    arena_release(&slab->arena);
+    memset(slab->free_list, 0, sizeof(slab->free_list));
+}
+
+/*
+ * Set of processed inodes, used to handle hardlinks
+ *
+ * Open addressing with linear probing over flat 16-byte (dev, ino) keys.
+ * The set is split into shards, each with its own lock and table, so
+ * walker threads rarely contend. A key of (0, 0) marks an empty slot,
+ * inode number 0 is never used by Linux filesystems.
+ */
+#define INODE_SET_SHARD_BITS 6
+#define INODE_SET_SHARDS (1 << INODE_SET_SHARD_BITS)
+#define INODE_SET_INITIAL_SIZE 1024    /* Slots per shard, power of two */
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+} inode_key_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    inode_key_t *slots;
+    size_t mask;    /* Number of slots - 1 */
+    size_t count;
+} __attribute__((aligned(64))) inode_shard_t;
+
+static inode_shard_t inode_table[INODE_SET_SHARDS];
+static pthread_once_t inode_table_once = PTHREAD_ONCE_INIT;
+
+static void inode_table_init(void) {
+    for (int i = 0; i < INODE_SET_SHARDS; i++) {
+        pthread_mutex_init(&inode_table[i].lock, NULL);
     }
-    inode_mark_seen(st.st_dev, st.st_ino);
+}
+
+/* Hash function for inode tracking (murmur3 finalizer over both halves) */
+static uint64_t inode_hash(uint64_t dev, uint64_t ino) {
+    uint64_t h = ino ^ (dev * 0x9e3779b97f4a7c15ULL);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* Find the slot holding key, or the empty slot where it belongs */
+static inode_key_t *inode_slot(inode_shard_t *shard, uint64_t hash,
+                               uint64_t dev, uint64_t ino) {
+    size_t i = (size_t)hash & shard->mask;
     
-    /* Calculate new UIDs/GIDs - handle unsigned arithmetic carefully */
-    if (g_offset < 0) {
-        /* Converting to privileged - check for underflow */
-        if (st.st_uid < (uid_t)(-g_offset) || st.st_gid < (gid_t)(-g_offset)) {
-            fprintf(stderr, "Error: %s already privileged or not a container\n", fpath);
-            g_errors++;
-            return 1; /* Stop traversal */
+    for (;;) {
+        inode_key_t *slot = &shard->slots[i];
+        if ((slot->dev == dev && slot->ino == ino) ||
+            (slot->dev == 0 && slot->ino == 0)) {
+            return slot;
         }
-        new_uid = st.st_uid - (uid_t)(-g_offset);
-        new_gid = st.st_gid - (gid_t)(-g_offset);
-    } else {
-        /* Converting to unprivileged - check for overflow */
-        new_uid = st.st_uid + (uid_t)g_offset;
-        new_gid = st.st_gid + (gid_t)g_offset;
-        if (new_uid > MAX_UID_GID || new_gid > MAX_UID_GID) {
-            fprintf(stderr, "Error: %s already unprivileged\n", fpath);
-            g_errors++;
-            return 1; /* Stop traversal */
+        i = (i + 1) & shard->mask;
+    }
+}
+
+/* Double the size of a shard, keys keep their hash order */
+static int inode_shard_grow(inode_shard_t *shard) {
+    size_t old_size = shard->slots ? shard->mask + 1 : 0;
+    size_t new_size = old_size ? old_size * 2 : INODE_SET_INITIAL_SIZE;
+    inode_key_t *old_slots = shard->slots;
+    
+    shard->slots = calloc(new_size, sizeof(inode_key_t));
+    if (!shard->slots) {
+        shard->slots = old_slots;
+        return -1;
+    }
+    shard->mask = new_size - 1;
+    for (size_t i = 0; i < old_size; i++) {
+        inode_key_t *key = &old_slots[i];
+        if (key->dev != 0 || key->ino != 0) {
+            *inode_slot(shard, inode_hash(key->dev, key->ino), key->dev, key->ino) = *key;
         }
     }
+    free(old_slots);
+    return 0;
+}
+
+/* Atomically check and mark an inode, returns 1 if it was already seen */
+static int inode_test_and_mark(dev_t dev, ino_t ino) {
+    uint64_t hash = inode_hash((uint64_t)dev, (uint64_t)ino);
+    inode_shard_t *shard = &inode_table[hash >> (64 - INODE_SET_SHARD_BITS)];
+    inode_key_t *slot;
+    int seen = 0;
     
-    /* Change ownership */
-    if (lchown(fpath, new_uid, new_gid) == -1) {
-        fprintf(stderr, "Error changing ownership of %s: %s\n", fpath, strerror(errno));
-        g_errors++;
-        return 0; /* Continue anyway */
+    pthread_once(&inode_table_once, inode_table_init);
+    pthread_mutex_lock(&shard->lock);
+    
+    /* Keep the load factor below 3/4 */
+    if ((shard->count + 1) * 4 > (shard->slots ? shard->mask + 1 : 0) * 3 &&
+        inode_shard_grow(shard) == -1) {
+        fprintf(stderr, "Failed to allocate memory for inode tracking\n");
+        pthread_mutex_unlock(&shard->lock);
+        return 0;
     }
     
-    /* For non-symlinks, restore mode and update ACLs */
-    if (!S_ISLNK(st.st_mode)) {
-        /* Restore mode (chown may strip setuid/setgid) */
-        if (chmod(fpath, st.st_mode) == -1) {
-            fprintf(stderr, "Warning: could not restore mode for %s: %s\n", 
-                    fpath, strerror(errno));
+    slot = inode_slot(shard, hash, (uint64_t)dev, (uint64_t)ino);
+    if (slot->dev == 0 && slot->ino == 0) {
+        slot->dev = (uint64_t)dev;
+        slot->ino = (uint64_t)ino;
+        shard->count++;
+    } else {
+        seen = 1;
+    }
+    
+    pthread_mutex_unlock(&shard->lock);
+    return seen;
+}
+
+/* Free inode table */
+static void free_inode_table(void) {
+    for (int i = 0; i < INODE_SET_SHARDS; i++) {
+        free(inode_table[i].slots);
+        inode_table[i].slots = NULL;
+        inode_table[i].mask = 0;
+        inode_table[i].count = 0;
+    }
+}
+
+/*
+ * Id mapping
+ *
+ * The lxc.idmap lines of a container map ranges of container ids to host
+ * ids, possibly split so that some ids pass through unchanged. Each
+ * direction is compiled into a sorted extent table. Lookups use a flat
+ * table when the source ids of a split map span few values and otherwise
+ * binary search the extents, so a map of one extent costs a compare and
+ * an add. Without lxc.idmap lines ids 0 to UID_GID_OFFSET map to
+ * UID_GID_OFFSET to MAX_UID_GID, as always. That map has both ranges
+ * share UID_GID_OFFSET; like the old fixed offset, such an id counts as a
+ * host id, i.e. as converted going to unprivileged and as still to convert
+ * going back to privileged (source_first).
+ */
+#define MAX_IDMAP_EXTENTS 64
+#define ID_MAP_TABLE_MAX (1 << 18)     /* Direct index up to 1 MiB per map */
+#define ID_UNMAPPED UINT32_MAX
+
+typedef struct {
+    uint32_t first;     /* First source id */
+    uint32_t target;    /* Id the first one maps to */
+    uint32_t count;
+} id_extent_t;
+
+/* lxc.idmap lines of a config, container ids to host ids */
+typedef struct {
+    id_extent_t uid[MAX_IDMAP_EXTENTS];
+    id_extent_t gid[MAX_IDMAP_EXTENTS];
+    int num_uid;
+    int num_gid;
+} lxc_idmap_t;
+
+typedef struct {
+    id_extent_t extents[MAX_IDMAP_EXTENTS]; /* Sorted by first, not overlapping */
+    int count;
+    uint32_t *table;    /* Direct index over [table_base, table_base + table_size) */
+    uint32_t table_base;
+    uint32_t table_size;
+} id_map_t;
+
+/* Id mapping of a container in the direction of a conversion */
+typedef struct {
+    id_map_t uid, gid;              /* Source ids to target ids */
+    id_map_t uid_back, gid_back;    /* Target ids back to source ids */
+    int single;                     /* One extent, the same for uids and gids */
+    int source_first;               /* Ids in both ranges are source ids */
+} id_mapping_t;
+
+static uint32_t id_map_lookup(const id_map_t *map, uint32_t id) {
+    const id_extent_t *e = map->extents;
+    int n = map->count;
+    
+    if (map->table) {
+        uint32_t i = id - map->table_base;
+        return i < map->table_size ? map->table[i] : ID_UNMAPPED;
+    }
+    
+    /* Branch-light: always log2(count) steps, the select compiles to a cmov */
+    while (n > 1) {
+        int half = n / 2;
+        e = e[half].first <= id ? e + half : e;
+        n -= half;
+    }
+    return n > 0 && id - e->first < e->count ? e->target + (id - e->first) : ID_UNMAPPED;
+}
+
+static int compare_extents(const void *a, const void *b) {
+    const id_extent_t *x = a, *y = b;
+    return (x->first > y->first) - (x->first < y->first);
+}
+
+/* Compile extents into a map, swapping source and target for reverse */
+static int id_map_build(id_map_t *map, const id_extent_t *extents, int count, int reverse) {
+    memset(map, 0, sizeof(*map));
+    for (int i = 0; i < count; i++) {
+        id_extent_t e = extents[i];
+        if (reverse) {
+            e.first = extents[i].target;
+            e.target = extents[i].first;
         }
-        
-        /* Update access ACL */
-        if (shift_acl(fpath, ACL_TYPE_ACCESS, g_offset) == -1) {
-            if (errno != ENOTSUP && errno != ENOSYS) {
-                fprintf(stderr, "Warning: could not update ACL for %s: %s\n", 
-                        fpath, strerror(errno));
-            }
+        if (e.count == 0 || (uint64_t)e.first + e.count > ID_UNMAPPED ||
+            (uint64_t)e.target + e.count > ID_UNMAPPED) {
+            fprintf(stderr, "Error: invalid lxc.idmap range %u %u %u\n",
+                    extents[i].first, extents[i].target, extents[i].count);
+            return -1;
+        }
+        map->extents[i] = e;
+    }
+    map->count = count;
+    qsort(map->extents, count, sizeof(id_extent_t), compare_extents);
+    for (int i = 1; i < count; i++) {
+        if ((uint64_t)map->extents[i - 1].first + map->extents[i - 1].count >
+            map->extents[i].first) {
+            fprintf(stderr, "Error: overlapping lxc.idmap ranges\n");
+            return -1;
         }
+    }
+    
+    if (count > 1) {
+        id_extent_t *last = &map->extents[count - 1];
+        uint64_t span = (uint64_t)last->first + last->count - map->extents[0].first;
         
-        /* Update default ACL for directories */
-        if (S_ISDIR(st.st_mode)) {
-            if (shift_acl(fpath, ACL_TYPE_DEFAULT, g_offset) == -1) {
-                if (errno != ENOTSUP && errno != ENOSYS) {
-                    fprintf(stderr, "Warning: could not update default ACL for %s: %s\n", 
-                            fpath, strerror(errno));
+        if (span <= ID_MAP_TABLE_MAX && (map->table = malloc(span * sizeof(uint32_t)))) {
+            map->table_base = map->extents[0].first;
+            map->table_size = (uint32_t)span;
+            memset(map->table, 0xff, span * sizeof(uint32_t));
+            for (int i = 0; i < count; i++) {
+                id_extent_t *e = &map->extents[i];
+                for (uint32_t k = 0; k < e->count; k++) {
+                    map->table[e->first - map->table_base + k] = e->target + k;
                 }
             }
         }
     }
+    return 0;
+}
+
+static void id_mapping_free(id_mapping_t *m) {
+    free(m->uid.table);
+    free(m->gid.table);
+    free(m->uid_back.table);
+    free(m->gid_back.table);
+    memset(m, 0, sizeof(*m));
+}
+
+/* Compile the mapping for converting to (un)privileged from a config's lxc.idmap */
+static int id_mapping_init(id_mapping_t *m, const lxc_idmap_t *idmap, int to_unprivileged) {
+    static const id_extent_t fixed = { 0, UID_GID_OFFSET, MAX_UID_GID - UID_GID_OFFSET + 1 };
+    const id_extent_t *uids = &fixed, *gids = &fixed;
+    int num_uid = 1, num_gid = 1;
+    
+    memset(m, 0, sizeof(*m));
+    if (idmap->num_uid > 0 || idmap->num_gid > 0) {
+        if (idmap->num_uid == 0 || idmap->num_gid == 0) {
+            fprintf(stderr, "Error: lxc.idmap needs both u and g ranges\n");
+            return -1;
+        }
+        uids = idmap->uid;
+        gids = idmap->gid;
+        num_uid = idmap->num_uid;
+        num_gid = idmap->num_gid;
+    }
+    if (id_map_build(&m->uid, uids, num_uid, !to_unprivileged) == -1 ||
+        id_map_build(&m->gid, gids, num_gid, !to_unprivileged) == -1 ||
+        id_map_build(&m->uid_back, uids, num_uid, to_unprivileged) == -1 ||
+        id_map_build(&m->gid_back, gids, num_gid, to_unprivileged) == -1) {
+        id_mapping_free(m);
+        return -1;
+    }
+    m->single = num_uid == 1 && num_gid == 1 &&
+                memcmp(&m->uid.extents[0], &m->gid.extents[0], sizeof(id_extent_t)) == 0;
+    m->source_first = !to_unprivileged &&
+                      !(m->single && m->uid.extents[0].first == m->uid.extents[0].target);
+    return 0;
+}
+
+static uint64_t fnv1a64(uint64_t h, const void *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ ((const unsigned char *)data)[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+/* Identifies a compiled mapping in journal headers */
+static uint64_t id_mapping_hash(const id_mapping_t *m) {
+    uint64_t h = 14695981039346656037ull;
+    
+    h = fnv1a64(h, &m->uid.count, sizeof(m->uid.count));
+    h = fnv1a64(h, m->uid.extents, m->uid.count * sizeof(id_extent_t));
+    h = fnv1a64(h, &m->gid.count, sizeof(m->gid.count));
+    return fnv1a64(h, m->gid.extents, m->gid.count * sizeof(id_extent_t));
+}
+
+/*
+ * Resume journal, one append-only file per container in JOURNAL_DIR.
+ *
+ * A header records the offset and id map being applied (the map's hash in
+ * its ino), then one record is appended
+ * for every directory whose whole subtree was converted without errors.
+ * Records are keyed by a hash of the configured path and the directory's
+ * inode number, which stay valid across reboots and dataset remounts. A
+ * rerun of the same conversion skips those subtrees and tolerates entries
+ * that were already shifted, which finishes partly done directories. The
+ * journal is removed once the config has been updated. Records are
+ * batched: before a batch is appended the filesystems it covers are synced
+ * with syncfs(), and the journal itself with fdatasync(), so a record never
+ * reaches the disk ahead of the changes it vouches for.
+ */
+#define JOURNAL_MAGIC 0x314a4350u   /* "PCJ1" */
+#define JOURNAL_SUBTREE 1
+#define JOURNAL_BATCH 256           /* Records per sync, or... */
+#define JOURNAL_BATCH_NS 1000000000LL /* ...the ones from the last second */
+
+typedef struct {
+    uint32_t type;      /* JOURNAL_MAGIC in the header */
+    uint32_t path;      /* Path hash, the offset in the header */
+    uint64_t ino;       /* id_mapping_hash() in the header */
+} journal_rec_t;
+
+typedef struct {
+    int fd;             /* -1 when not journaling */
+    int resume;         /* Continues an interrupted conversion */
+    journal_rec_t *done; /* Completed subtrees from earlier runs, sorted */
+    size_t num_done;
+    char path[MAX_PATH_LEN];
+    pthread_mutex_t lock; /* Guards fd and the batch */
+    journal_rec_t batch[JOURNAL_BATCH];
+    int batch_fs[JOURNAL_BATCH]; /* Filesystem of each record, for syncfs() */
+    int batch_count;
+    struct timespec batch_start;
+} journal_t;
+
+/*
+ * Census of one filesystem path for --dry-run, updated atomically by the
+ * walker threads. Ids up to CENSUS_IDS get a bucket each, larger ones share
+ * the last; the histograms are calloc'ed, so only used pages cost memory.
+ */
+#define CENSUS_IDS (1 << 20)
+#define CENSUS_TOP_IDS 8               /* Most common ids listed per path */
+#define CENSUS_CHOWN_SAMPLES 256       /* fchown calls timed for the projection */
+
+typedef struct {
+    uint64_t dirs;
+    uint64_t files;             /* Everything that is not a directory */
+    uint64_t hardlinked;        /* Inodes with several links */
+    uint64_t extra_links;       /* Further names of those, not converted again */
+    uint64_t acl_access;
+    uint64_t acl_default;
+    uint64_t uid_class[3];      /* Indexed by ID_SOURCE, ID_TARGET, ID_OUT */
+    uint64_t gid_class[3];
+    uint64_t *uid_hist;         /* CENSUS_IDS + 1 buckets */
+    uint64_t *gid_hist;
+    double chown_cost;          /* Seconds per fchown on this filesystem, 0 if unknown */
+} census_t;
+
+struct file_ref;
+struct acl_xattr_entry;
+
+/*
+ * One filesystem path being converted. Several jobs share the walker
+ * threads, each keeps its own counters and stops on its own.
+ */
+typedef struct convert_job {
+    const char *path;
+    int offset;                 /* Direction: +UID_GID_OFFSET or -UID_GID_OFFSET */
+    const id_mapping_t *map;
+    int container;              /* Index of the owning container in a batch */
+    journal_t *journal;         /* NULL when not journaling */
+    uint32_t path_hash;         /* Journal key of this path */
+    dev_t dev;                  /* Filesystem of the root, others are not entered */
+    char device[272];           /* Scheduling key: ZFS pool or backing device */
+    uint64_t files_processed;   /* Updated atomically */
+    uint64_t errors;            /* Updated atomically */
+    uint64_t pending;           /* Items of this job queued or in flight */
+    int abort;                  /* Set when process_file() asks to stop */
+    int idempotent;             /* Classify ids instead of stopping on converted ones */
+    uint64_t skipped;           /* Entries already in the target range, atomic */
+    uint64_t out_of_range;      /* Entries left alone, atomic */
+    char *report[REPORT_LIMIT]; /* The first of them, with their ids */
+    int no_acl;                 /* Filesystem has no ACL support */
+    int no_handles;             /* Filesystem cannot export file handles */
+    uint32_t log_root;          /* Change log ROOT record of this path */
+    census_t *census;           /* Dry run: count entries instead of converting */
+    int verify;                 /* Check entries are in the target range instead */
+    int mount_fd;               /* Root, for open_by_handle_at(), or -1 */
+    /* Per-inode kernel and ACL id loop, picked by job_select_kernel() */
+    int (*process)(struct convert_job *job, const struct file_ref *ref, const struct stat *st);
+    uint32_t (*acl_ids)(const id_mapping_t *m, struct acl_xattr_entry *entries, size_t count,
+                        uint32_t *shifted);
+    struct timespec start;      /* When the job started running */
+    double elapsed;             /* Seconds it ran */
+    int state;                  /* JOB_WAITING, JOB_RUNNING or JOB_DONE */
+    int result;
+} convert_job_t;
+
+#define JOB_WAITING 0
+#define JOB_RUNNING 1
+#define JOB_DONE 2
+
+static void job_error(convert_job_t *job) {
+    __atomic_add_fetch(&job->errors, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Id classes for idempotent conversion: ids the mapping produces are in the
+ * target range (ids passed through count as converted), ids it maps are in
+ * the source range, and anything else is out of range. An id in both is a
+ * target id unless the mapping is source_first.
+ */
+#define ID_SOURCE 0
+#define ID_TARGET 1
+#define ID_OUT 2
+
+static int id_class(const id_mapping_t *m, uint32_t id, int is_gid) {
+    uint32_t to = id_map_lookup(is_gid ? &m->gid : &m->uid, id);
+    
+    if (m->source_first && to != ID_UNMAPPED && to != id) {
+        return ID_SOURCE;
+    }
+    if (id_map_lookup(is_gid ? &m->gid_back : &m->uid_back, id) != ID_UNMAPPED) {
+        return ID_TARGET;
+    }
+    return to != ID_UNMAPPED ? ID_SOURCE : ID_OUT;
+}
+
+/* Note an entry for the report at the end of the job, keeping the first few */
+static void job_reportf(convert_job_t *job, const char *fmt, ...) {
+    uint64_t n = __atomic_fetch_add(&job->out_of_range, 1, __ATOMIC_RELAXED);
+    va_list ap;
+    
+    job_error(job);
+    if (n < REPORT_LIMIT) {
+        va_start(ap, fmt);
+        if (vasprintf(&job->report[n], fmt, ap) == -1) {
+            job->report[n] = NULL;
+        }
+        va_end(ap);
+    }
+}
+
+/* Note an entry that is neither converted nor convertible */
+static void job_report(convert_job_t *job, const char *path, uid_t uid, gid_t gid) {
+    job_reportf(job, "%s (uid %u, gid %u)", path, (unsigned)uid, (unsigned)gid);
+}
+
+/*
+ * Messages from walker threads. Each thread formats its errors and
+ * warnings into its own single-producer ring, with no lock and no write,
+ * and the reporter thread prints them. Messages of one kind (call site
+ * and errno) are printed REPORT_REPEAT times and then only counted, so a
+ * subtree failing on every entry costs the walk nothing. While its ring is
+ * full a thread only counts messages by kind. Threads without a ring
+ * print directly.
+ */
+#define REPORT_OVERFLOW 8               /* Kinds a full ring counts */
+
+typedef struct {
+    const char *fmt;            /* Call site, tells kinds apart */
+    int err;                    /* errno to append, 0 for none */
+    char text[240];
+} report_msg_t;
+
+typedef struct {
+    const char *fmt;
+    int err;
+    uint64_t count;             /* Seen */
+    uint64_t hidden;            /* Seen but not printed */
+} report_kind_t;
+
+typedef struct {
+    report_msg_t msgs[REPORT_RING];
+    uint32_t head;              /* Next to print, advanced by the reporter */
+    uint32_t tail;              /* Next to fill, advanced by the owner */
+    report_kind_t overflow[REPORT_OVERFLOW]; /* Owner only, read after the walk */
+    uint64_t dropped;           /* Not even counted by kind */
+} report_ring_t;
+
+static __thread report_ring_t *t_report;
+
+static void walk_report(int err, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void walk_report(int err, const char *fmt, ...) {
+    report_ring_t *ring = t_report;
+    report_msg_t *msg;
+    va_list ap;
     
-    g_files_processed++;
-    if (g_files_processed % 1000 == 0) {
-        printf("\rProcessed %"PRIu64" items...", g_files_processed);
+    va_start(ap, fmt);
+    if (!ring) {
         fflush(stdout);
+        vfprintf(stderr, fmt, ap);
+        fprintf(stderr, err ? ": %s\n" : "\n", strerror(err));
+        va_end(ap);
+        return;
+    }
+    if (ring->tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == REPORT_RING) {
+        int i = 0;
+        
+        while (i < REPORT_OVERFLOW && ring->overflow[i].fmt &&
+               (ring->overflow[i].fmt != fmt || ring->overflow[i].err != err)) {
+            i++;
+        }
+        if (i == REPORT_OVERFLOW) {
+            ring->dropped++;
+        } else {
+            ring->overflow[i].fmt = fmt;
+            ring->overflow[i].err = err;
+            ring->overflow[i].count++;
+        }
+        va_end(ap);
+        return;
+    }
+    msg = &ring->msgs[ring->tail % REPORT_RING];
+    msg->fmt = fmt;
+    msg->err = err;
+    vsnprintf(msg->text, sizeof(msg->text), fmt, ap);
+    va_end(ap);
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+/* FNV-1a */
+static uint32_t journal_path_hash(const char *path) {
+    uint32_t h = 2166136261u;
+    
+    while (*path) {
+        h = (h ^ (unsigned char)*path++) * 16777619u;
     }
+    return h;
+}
+
+static int journal_compare(const void *a, const void *b) {
+    const journal_rec_t *x = a, *y = b;
     
-    return 0; /* Continue traversal */
+    if (x->path != y->path) {
+        return x->path < y->path ? -1 : 1;
+    }
+    return (x->ino > y->ino) - (x->ino < y->ino);
 }
 
-/* Convert a filesystem path */
-static int convert_path(const char *path, int offset) {
+/*
+ * Open the journal of a container, loading it if an earlier run was
+ * interrupted. Fails if that run was converting in the other direction or
+ * with another id map.
+ */
+static int journal_open(journal_t *j, int container_id, int offset, const id_mapping_t *map) {
     struct stat st;
+    journal_rec_t header = { JOURNAL_MAGIC, (uint32_t)offset, id_mapping_hash(map) };
+    size_t count;
     
-    printf("\nConverting: %s\n", path);
+    memset(j, 0, sizeof(*j));
+    j->fd = -1;
+    pthread_mutex_init(&j->lock, NULL);
+    if (mkdir(JOURNAL_DIR, 0700) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Warning: cannot create %s: %s, conversion will not be resumable\n",
+                JOURNAL_DIR, strerror(errno));
+        return 0;
+    }
+    snprintf(j->path, sizeof(j->path), JOURNAL_DIR "/%d.journal", container_id);
+    j->fd = open(j->path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (j->fd == -1 || fstat(j->fd, &st) == -1) {
+        fprintf(stderr, "Warning: cannot open %s: %s, conversion will not be resumable\n",
+                j->path, strerror(errno));
+        if (j->fd != -1) {
+            close(j->fd);
+        }
+        j->fd = -1;
+        return 0;
+    }
     
-    /* Check if path exists */
-    if (stat(path, &st) == -1) {
-        fprintf(stderr, "Error: Path %s does not exist: %s\n", path, strerror(errno));
-        return -1;
+    if (st.st_size < (off_t)sizeof(header)) {
+        /* New journal, or one that died before its header was complete */
+        if (ftruncate(j->fd, 0) == -1 ||
+            write(j->fd, &header, sizeof(header)) != (ssize_t)sizeof(header)) {
+            fprintf(stderr, "Error writing %s: %s\n", j->path, strerror(errno));
+            close(j->fd);
+            j->fd = -1;
+            return -1;
+        }
+        return 0;
     }
     
-    if (!S_ISDIR(st.st_mode)) {
-        fprintf(stderr, "Error: Path %s is not a directory\n", path);
-        return -1;
+    count = st.st_size / sizeof(journal_rec_t);
+    j->done = malloc(count * sizeof(journal_rec_t));
+    if (!j->done || pread(j->fd, j->done, count * sizeof(journal_rec_t), 0) !=
+                    (ssize_t)(count * sizeof(journal_rec_t))) {
+        fprintf(stderr, "Error reading %s: %s\n", j->path, strerror(errno ? errno : EIO));
+        goto fail;
+    }
+    if (j->done[0].type != JOURNAL_MAGIC) {
+        fprintf(stderr, "Error: %s is not a privconvert journal\n", j->path);
+        goto fail;
+    }
+    if ((int)j->done[0].path != offset) {
+        fprintf(stderr, "Error: %s belongs to an interrupted conversion with offset %+d,\n"
+                "rerun that conversion or remove the journal\n",
+                j->path, (int)j->done[0].path);
+        goto fail;
+    }
+    if (j->done[0].ino != header.ino) {
+        fprintf(stderr, "Error: %s belongs to an interrupted conversion with another id map,\n"
+                "rerun it with the lxc.idmap it had or remove the journal\n", j->path);
+        goto fail;
+    }
+    
+    /* Drop a record torn by the crash so appends stay aligned */
+    if ((off_t)(count * sizeof(journal_rec_t)) != st.st_size &&
+        ftruncate(j->fd, count * sizeof(journal_rec_t)) == -1) {
+        fprintf(stderr, "Error truncating %s: %s\n", j->path, strerror(errno));
+        goto fail;
     }
     
-    g_offset = offset;
-    g_files_processed = 0;
-    g_errors = 0;
+    memmove(j->done, j->done + 1, (count - 1) * sizeof(journal_rec_t));
+    j->num_done = count - 1;
+    qsort(j->done, j->num_done, sizeof(journal_rec_t), journal_compare);
+    j->resume = 1;
+    return 0;
     
-    /* Walk the directory tree */
-    if (nftw(path, process_file, 64, FTW_PHYS | FTW_MOUNT) == -1) {
-        fprintf(stderr, "\nError walking directory tree: %s\n", strerror(errno));
-        return -1;
+fail:
+    free(j->done);
+    j->done = NULL;
+    close(j->fd);
+    j->fd = -1;
+    return -1;
+}
+
+/* Whether an earlier run finished the subtree below a directory */
+static int journal_done(const convert_job_t *job, uint64_t ino) {
+    const journal_t *j = job->journal;
+    journal_rec_t key = { JOURNAL_SUBTREE, job->path_hash, ino };
+    
+    return j && j->num_done > 0 &&
+           bsearch(&key, j->done, j->num_done, sizeof(journal_rec_t), journal_compare);
+}
+
+/*
+ * Append the batched records once their filesystems are synced. The batch
+ * is taken under the lock and written outside it, so walker threads only
+ * wait for the syncs when they fill the next batch.
+ */
+static void journal_flush(journal_t *j) {
+    journal_rec_t batch[JOURNAL_BATCH];
+    int fs[JOURNAL_BATCH];
+    int count, num_fs = 0;
+    int fd;
+    
+    pthread_mutex_lock(&j->lock);
+    count = j->batch_count;
+    fd = j->fd;
+    for (int i = 0; i < count; i++) {
+        int known = 0;
+        
+        for (int k = 0; k < num_fs; k++) {
+            known |= fs[k] == j->batch_fs[i];
+        }
+        if (!known) {
+            fs[num_fs++] = j->batch_fs[i];
+        }
+    }
+    memcpy(batch, j->batch, count * sizeof(journal_rec_t));
+    j->batch_count = 0;
+    pthread_mutex_unlock(&j->lock);
+    if (count == 0 || fd == -1) {
+        return;
+    }
+    
+    for (int k = 0; k < num_fs; k++) {
+        if (fs[k] == -1) {
+            sync();
+        } else if (syncfs(fs[k]) == -1) {
+            walk_report(errno, "Warning: cannot sync filesystem for %s", j->path);
+            return;
+        }
+    }
+    if (write(fd, batch, count * sizeof(journal_rec_t)) !=
+        (ssize_t)(count * sizeof(journal_rec_t)) || fdatasync(fd) == -1) {
+        walk_report(errno, "Warning: cannot write %s, conversion will not be resumable", j->path);
+        pthread_mutex_lock(&j->lock);
+        if (j->fd == fd) {
+            close(fd);
+            j->fd = -1;
+        }
+        pthread_mutex_unlock(&j->lock);
+    }
+}
+
+/* Note a finished subtree in the journal's batch */
+static void journal_record(convert_job_t *job, uint64_t ino) {
+    journal_t *j = job->journal;
+    struct timespec now;
+    int full;
+    
+    if (!j) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&j->lock);
+    if (j->fd == -1) {
+        pthread_mutex_unlock(&j->lock);
+        return;
+    }
+    if (j->batch_count == 0) {
+        j->batch_start = now;
+    }
+    j->batch[j->batch_count].type = JOURNAL_SUBTREE;
+    j->batch[j->batch_count].path = job->path_hash;
+    j->batch[j->batch_count].ino = ino;
+    j->batch_fs[j->batch_count] = job->mount_fd;
+    j->batch_count++;
+    full = j->batch_count == JOURNAL_BATCH ||
+           (now.tv_sec - j->batch_start.tv_sec) * 1000000000LL +
+           (now.tv_nsec - j->batch_start.tv_nsec) >= JOURNAL_BATCH_NS;
+    pthread_mutex_unlock(&j->lock);
+    if (full) {
+        journal_flush(j);
+    }
+}
+
+/* Close a journal, removing it when the conversion is complete */
+static void journal_close(journal_t *j, int complete) {
+    if (j->fd != -1) {
+        close(j->fd);
+        if (complete && unlink(j->path) == -1) {
+            fprintf(stderr, "Warning: could not remove %s: %s\n", j->path, strerror(errno));
+        }
+    }
+    free(j->done);
+    j->done = NULL;
+    j->fd = -1;
+}
+
+/*
+ * Change log (--change-log), replayed by --undo. A header is followed by
+ * CONTAINER records (id, previous state, config path), ROOT records (one
+ * per converted path) and an ENTRY record for every inode changed: the
+ * previous ids and mode, and the previous ACL xattrs if they were
+ * rewritten, keyed by the path relative to its root and, where the
+ * filesystem exports them, a file handle that reopens the inode without
+ * any path lookup. Walker threads fill their own buffer and append it
+ * whole, so the file is written sequentially in large blocks, and an
+ * entry is only changed once its record has been synced (change_commit()).
+ */
+#define CHANGELOG_MAGIC 0x314c4350u /* "PCL1" */
+#define CHANGELOG_VERSION 2
+#define CHANGELOG_CONTAINER 1
+#define CHANGELOG_ROOT 2
+#define CHANGELOG_ENTRY 3
+#define CHANGELOG_BUF_SIZE (256 * 1024) /* Per thread, holds the largest record */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+} changelog_header_t;
+
+typedef struct {
+    uint64_t dev;           /* ENTRY and ROOT: filesystem when logged */
+    uint64_t ino;
+    uint16_t type;
+    uint16_t path_len;      /* Bytes of path after the record, no NUL */
+    uint32_t root;          /* ENTRY: its ROOT record; ROOT: its CONTAINER record */
+    uint32_t uid;           /* CONTAINER: id */
+    uint32_t gid;           /* CONTAINER: previously unprivileged */
+    uint32_t mode;          /* CONTAINER: ROOTFS_IDMAP_* applied */
+    uint32_t acl_len[2];    /* Previous access and default ACL, after the handle */
+    int32_t handle_type;
+    uint16_t handle_len;    /* Bytes of file handle after the path, 0 if none */
+    uint16_t reserved;
+} changelog_rec_t;
+
+typedef struct {
+    char *data;
+    size_t used;
+} changelog_buf_t;
+
+/* An ACL xattr that is being rewritten, written once it is logged */
+typedef struct {
+    void *data;         /* Previous value, len bytes */
+    void *shifted;      /* New value, len bytes in the same allocation */
+    uint32_t len;
+} acl_saved_t;
+
+static int g_changelog_fd = -1;
+static int g_changelog_failed = 0;
+static pthread_mutex_t changelog_lock = PTHREAD_MUTEX_INITIALIZER;
+static changelog_buf_t changelog_main;
+static __thread changelog_buf_t *t_log;
+
+static size_t changelog_rec_size(const changelog_rec_t *rec) {
+    size_t size = sizeof(*rec) + rec->path_len + rec->handle_len +
+                  rec->acl_len[0] + rec->acl_len[1];
+    return (size + 7) & ~(size_t)7;
+}
+
+static int changelog_flush(changelog_buf_t *b) {
+    size_t done = 0;
+    int result;
+    
+    pthread_mutex_lock(&changelog_lock);
+    while (done < b->used) {
+        ssize_t n = write(g_changelog_fd, b->data + done, b->used - done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (!g_changelog_failed) {
+                walk_report(n ? errno : ENOSPC, "Error writing change log");
+            }
+            g_changelog_failed = 1;
+            break;
+        }
+        done += n;
+    }
+    pthread_mutex_unlock(&changelog_lock);
+    result = done == b->used ? 0 : -1;
+    b->used = 0;
+    return result;
+}
+
+static int changelog_add(changelog_buf_t *b, const changelog_rec_t *rec, const char *path,
+                         const void *handle, const acl_saved_t *acls) {
+    size_t size = changelog_rec_size(rec);
+    char *p;
+    
+    if (!b->data && !(b->data = malloc(CHANGELOG_BUF_SIZE))) {
+        g_changelog_failed = 1;
+        return -1;
+    }
+    if (b->used + size > CHANGELOG_BUF_SIZE && changelog_flush(b) == -1) {
+        return -1;
+    }
+    p = b->data + b->used;
+    memset(p, 0, size);
+    memcpy(p, rec, sizeof(*rec));
+    p += sizeof(*rec);
+    memcpy(p, path, rec->path_len);
+    p += rec->path_len;
+    if (rec->handle_len > 0) {
+        memcpy(p, handle, rec->handle_len);
+        p += rec->handle_len;
+    }
+    for (int i = 0; acls && i < 2; i++) {
+        memcpy(p, acls[i].data, acls[i].len);
+        p += acls[i].len;
+    }
+    b->used += size;
+    return 0;
+}
+
+/* Append a buffer and wait until the log is on disk */
+static int changelog_sync(changelog_buf_t *b) {
+    if (changelog_flush(b) == -1) {
+        return -1;
+    }
+    if (fdatasync(g_changelog_fd) == -1) {
+        int err = errno;
+        
+        pthread_mutex_lock(&changelog_lock);
+        if (!g_changelog_failed) {
+            walk_report(err, "Error syncing change log");
+        }
+        g_changelog_failed = 1;
+        pthread_mutex_unlock(&changelog_lock);
+        return -1;
+    }
+    return 0;
+}
+
+/* Create the log, refusing to overwrite one that may be needed for an undo */
+static int changelog_open(const char *path) {
+    changelog_header_t header = { CHANGELOG_MAGIC, CHANGELOG_VERSION };
+    
+    g_changelog_fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0600);
+    if (g_changelog_fd == -1) {
+        fprintf(stderr, "Error creating change log %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (write(g_changelog_fd, &header, sizeof(header)) != (ssize_t)sizeof(header)) {
+        fprintf(stderr, "Error writing change log %s: %s\n", path, strerror(errno));
+        close(g_changelog_fd);
+        g_changelog_fd = -1;
+        return -1;
+    }
+    t_log = &changelog_main;
+    return 0;
+}
+
+/* Flush and sync the log, -1 if any record was lost */
+static int changelog_close(void) {
+    int result = 0;
+    
+    if (g_changelog_fd == -1) {
+        return 0;
+    }
+    changelog_flush(&changelog_main);
+    free(changelog_main.data);
+    changelog_main.data = NULL;
+    t_log = NULL;
+    if (fsync(g_changelog_fd) == -1 || g_changelog_failed) {
+        result = -1;
+    }
+    close(g_changelog_fd);
+    g_changelog_fd = -1;
+    return result;
+}
+
+/*
+ * A file being converted. Open files (directories) are addressed through
+ * their own descriptor, everything else by name relative to the open
+ * directory that holds it, so no call has to resolve the full path.
+ */
+typedef struct file_ref {
+    int fd;             /* Descriptor of the file itself, or -1 */
+    int dirfd;          /* Directory holding name, used when fd is -1 */
+    const char *name;
+    const char *path;   /* Full path, for messages only */
+    struct walk_dir *dir; /* Open directory behind dirfd or fd, lets a change wait for the log */
+} file_ref_t;
+
+/*
+ * Path usable by the path-based xattr calls for an entry addressed by name.
+ * Deep paths go through /proc/self/fd when it is mounted, which costs a
+ * fixed handful of lookups.
+ */
+static const char *ref_acl_path(const file_ref_t *ref, char *buf, size_t len) {
+    int depth = 0;
+    int n;
+    
+    if (!g_proc_fd) {
+        return ref->path;
+    }
+    for (const char *p = ref->path; *p && depth < PROC_FD_MIN_DEPTH; p++) {
+        depth += *p == '/';
+    }
+    if (depth < PROC_FD_MIN_DEPTH) {
+        return ref->path;
+    }
+    n = snprintf(buf, len, "/proc/self/fd/%d/%s", ref->dirfd, ref->name);
+    return (n > 0 && (size_t)n < len) ? buf : ref->path;
+}
+
+static int ref_chown(const file_ref_t *ref, uid_t uid, gid_t gid) {
+    if (ref->fd >= 0) {
+        return STATS_CALL(STATS_CHOWN, fchown(ref->fd, uid, gid));
+    }
+    return STATS_CALL(STATS_CHOWN, fchownat(ref->dirfd, ref->name, uid, gid,
+                                            AT_SYMLINK_NOFOLLOW));
+}
+
+/* Only called for non-symlinks, fchmodat() cannot portably refuse to follow */
+static int ref_chmod(const file_ref_t *ref, mode_t mode) {
+    if (ref->fd >= 0) {
+        return STATS_CALL(STATS_CHMOD, fchmod(ref->fd, mode));
+    }
+    return STATS_CALL(STATS_CHMOD, fchmodat(ref->dirfd, ref->name, mode, 0));
+}
+
+/* File handle of an entry, without following symlinks */
+static int ref_handle(const file_ref_t *ref, struct file_handle *fh) {
+    int mount_id;
+    
+    fh->handle_bytes = MAX_HANDLE_SZ;
+    if (ref->fd >= 0) {
+        return STATS_CALL(STATS_HANDLE, name_to_handle_at(ref->fd, "", fh, &mount_id,
+                                                          AT_EMPTY_PATH));
+    }
+    return STATS_CALL(STATS_HANDLE, name_to_handle_at(ref->dirfd, ref->name, fh, &mount_id, 0));
+}
+
+/* Record an entry's previous state before it is changed */
+static int changelog_entry(convert_job_t *job, const file_ref_t *ref, const struct stat *st,
+                           const acl_saved_t *acls) {
+    const char *rel = ref->path + strlen(job->path);
+    union {
+        struct file_handle fh;
+        char buf[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+    } handle;
+    changelog_rec_t rec;
+    
+    while (*rel == '/') {
+        rel++;
+    }
+    memset(&rec, 0, sizeof(rec));
+    rec.type = CHANGELOG_ENTRY;
+    rec.dev = st->st_dev;
+    rec.ino = st->st_ino;
+    rec.root = job->log_root;
+    rec.uid = st->st_uid;
+    rec.gid = st->st_gid;
+    rec.mode = st->st_mode;
+    rec.path_len = (uint16_t)strlen(rel);
+    rec.acl_len[0] = acls[0].len;
+    rec.acl_len[1] = acls[1].len;
+    
+    /* Without a handle undo falls back to the path */
+    if (!__atomic_load_n(&job->no_handles, __ATOMIC_RELAXED)) {
+        if (ref_handle(ref, &handle.fh) == 0) {
+            rec.handle_type = handle.fh.handle_type;
+            rec.handle_len = (uint16_t)handle.fh.handle_bytes;
+        } else if (errno == EOPNOTSUPP || errno == ENOSYS) {
+            __atomic_store_n(&job->no_handles, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (strlen(rel) > UINT16_MAX ||
+        changelog_add(t_log, &rec, rel, handle.fh.f_handle, acls) == -1) {
+        walk_report(0, "Error: could not log %s, it is left unchanged", ref->path);
+        job_error(job);
+        return -1;
+    }
+    return 0;
+}
+
+static void statx_to_stat(const struct statx *stx, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    st->st_ino = stx->stx_ino;
+    st->st_mode = stx->stx_mode;
+    st->st_nlink = stx->stx_nlink;
+    st->st_uid = stx->stx_uid;
+    st->st_gid = stx->stx_gid;
+}
+
+/*
+ * Stat name relative to dirfd (or dirfd itself when name is ""), without
+ * following symlinks. Only the fields conversion needs are requested, and
+ * kernels without statx() fall back to fstatat().
+ */
+static int stat_at(int dirfd, const char *name, struct stat *st) {
+    static int no_statx = 0;
+    int flags = AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT | (*name ? 0 : AT_EMPTY_PATH);
+    struct statx stx;
+    
+    if (!__atomic_load_n(&no_statx, __ATOMIC_RELAXED)) {
+        if (STATS_CALL(STATS_STAT, statx(dirfd, name, flags, STAT_MASK, &stx)) == 0) {
+            statx_to_stat(&stx, st);
+            return 0;
+        }
+        if (errno != ENOSYS) {
+            return -1;
+        }
+        __atomic_store_n(&no_statx, 1, __ATOMIC_RELAXED);
+    }
+    return STATS_CALL(STATS_STAT, fstatat(dirfd, name, st, flags));
+}
+
+/*
+ * POSIX ACLs are rewritten at the xattr level. The kernel stores them as a
+ * little endian header followed by fixed size {tag, perm, id} entries (see
+ * <linux/posix_acl_xattr.h>), so shifting ids is an in-place add over an
+ * array that is read into a stack buffer and written back only if an id
+ * changed.
+ */
+#define ACL_XATTR_VERSION 0x0002
+#define ACL_TAG_USER 0x02
+#define ACL_TAG_GROUP 0x08
+
+typedef struct acl_xattr_entry {
+    uint16_t e_tag;
+    uint16_t e_perm;
+    uint32_t e_id;
+} acl_xattr_entry_t;
+
+static ssize_t ref_getxattr(const file_ref_t *ref, const char *path, const char *xattr,
+                            void *buf, size_t len) {
+    if (ref->fd >= 0) {
+        return STATS_CALL(STATS_GETXATTR, fgetxattr(ref->fd, xattr, buf, len));
+    }
+    return STATS_CALL(STATS_GETXATTR, lgetxattr(path, xattr, buf, len));
+}
+
+static int ref_setxattr(const file_ref_t *ref, const char *path, const char *xattr,
+                        const void *buf, size_t len) {
+    if (ref->fd >= 0) {
+        return STATS_CALL(STATS_SETXATTR, fsetxattr(ref->fd, xattr, buf, len, XATTR_REPLACE));
+    }
+    return STATS_CALL(STATS_SETXATTR, lsetxattr(path, xattr, buf, len, XATTR_REPLACE));
+}
+
+/*
+ * Shift the ids of ACL_USER/ACL_GROUP entries in place, returning non-zero
+ * if one is outside the map. Always inlined with constant flags, so each
+ * instance has the mapping strategy and idempotence folded in.
+ */
+static inline __attribute__((always_inline))
+uint32_t acl_shift_ids(const id_mapping_t *m, acl_xattr_entry_t *entries, size_t count,
+                       uint32_t *shifted, const int single, const int idempotent) {
+    uint32_t bad = 0, changed = 0;
+    
+    if (single) {
+        /*
+         * One extent: ids in [lo, hi] are shifted by delta. Idempotent jobs
+         * also leave [keep_lo, keep_hi], the target range, alone; otherwise
+         * nothing is kept. An id in both is kept unless source_first.
+         */
+        const id_extent_t *e = &m->uid.extents[0];
+        uint32_t delta = e->target - e->first;
+        uint32_t lo = e->first, hi = e->first + e->count - 1;
+        uint32_t keep_lo = 1, keep_hi = 0;
+        uint32_t keep_wins = 0;
+        
+        if (idempotent) {
+            keep_lo = e->target;
+            keep_hi = e->target + e->count - 1;
+            keep_wins = !m->source_first;
+        }
+        
+        /* Branch-free so the compiler can vectorize it for large ACLs */
+        for (size_t i = 0; i < count; i++) {
+            uint32_t tag = le16toh(entries[i].e_tag);
+            uint32_t id = le32toh(entries[i].e_id);
+            uint32_t is_id = (tag == ACL_TAG_USER) | (tag == ACL_TAG_GROUP);
+            uint32_t keep = is_id & (id >= keep_lo) & (id <= keep_hi);
+            uint32_t move = is_id & (id >= lo) & (id <= hi) & ((keep & keep_wins) ^ 1);
+            
+            bad |= is_id & ((move | keep) ^ 1);
+            changed |= move & (delta != 0);
+            entries[i].e_id = htole32(id + (delta & -move));
+        }
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            uint32_t tag = le16toh(entries[i].e_tag);
+            uint32_t id = le32toh(entries[i].e_id);
+            int is_gid = tag == ACL_TAG_GROUP;
+            uint32_t to;
+            
+            if (tag != ACL_TAG_USER && !is_gid) {
+                continue;
+            }
+            if (idempotent && id_class(m, id, is_gid) == ID_TARGET) {
+                continue;
+            }
+            to = id_map_lookup(is_gid ? &m->gid : &m->uid, id);
+            if (to == ID_UNMAPPED) {
+                bad = 1;
+                continue;
+            }
+            changed |= to != id;
+            entries[i].e_id = htole32(to);
+        }
+    }
+    
+    *shifted |= changed;
+    return bad;
+}
+
+/*
+ * Shift the ids of the ACL_USER/ACL_GROUP entries of one ACL xattr. A
+ * missing ACL is not an error, and the first file showing the filesystem
+ * has no xattr support turns ACLs off for the rest of the walk. With saved
+ * the ACL is not written, saved receives its previous and its new value
+ * for acl_write() once they are logged.
+ */
+static int shift_acl(convert_job_t *job, const file_ref_t *ref, const char *xattr,
+                     acl_saved_t *saved) {
+    const id_mapping_t *m = job->map;
+    uint32_t stackbuf[ACL_XATTR_BUF_SIZE / sizeof(uint32_t)];
+    char pathbuf[PATH_MAX];
+    const char *path = NULL;
+    void *buf = stackbuf;
+    ssize_t size;
+    uint32_t shifted = 0;
+    int result = -1;
+    
+    if (__atomic_load_n(&job->no_acl, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    if (ref->fd < 0) {
+        path = ref_acl_path(ref, pathbuf, sizeof(pathbuf));
+    }
+    
+    size = ref_getxattr(ref, path, xattr, buf, sizeof(stackbuf));
+    if (size == -1 && errno == ERANGE) {
+        /* Larger than the stack buffer, rare enough to allocate */
+        size = ref_getxattr(ref, path, xattr, NULL, 0);
+        if (size > 0 && (buf = malloc(size))) {
+            size = ref_getxattr(ref, path, xattr, buf, size);
+        } else {
+            buf = stackbuf;
+            size = -1;
+        }
+    }
+    if (size == -1) {
+        if (errno == ENODATA) {
+            return 0;
+        }
+        if (errno == ENOTSUP || errno == ENOSYS) {
+            /* ACLs not supported on this filesystem */
+            __atomic_store_n(&job->no_acl, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+        goto out;
+    }
+    
+    if (size < (ssize_t)sizeof(uint32_t) ||
+        (size - sizeof(uint32_t)) % sizeof(acl_xattr_entry_t) != 0 ||
+        le32toh(*(uint32_t *)buf) != ACL_XATTR_VERSION) {
+        errno = EINVAL;
+        goto out;
+    }
+    
+    /* Keep the original for the change log, ids are shifted in place */
+    if (saved) {
+        if (!(saved->data = malloc(2 * (size_t)size))) {
+            goto out;
+        }
+        memcpy(saved->data, buf, size);
+        saved->shifted = (char *)saved->data + size;
+        saved->len = (uint32_t)size;
+    }
+    
+    acl_xattr_entry_t *entries = (acl_xattr_entry_t *)((char *)buf + sizeof(uint32_t));
+    size_t count = (size - sizeof(uint32_t)) / sizeof(acl_xattr_entry_t);
+    
+    if (job->acl_ids(m, entries, count, &shifted)) {
+        walk_report(0, "Error: ACL has ids outside the id map");
+        errno = ERANGE;
+        goto out;
+    }
+    
+    /* Apply updated ACL if needed, a logged one is written by the caller */
+    if (saved) {
+        memcpy(saved->shifted, buf, size);
+    } else if (shifted && ref_setxattr(ref, path, xattr, buf, size) == -1) {
+        goto out;
+    }
+    result = 0;
+    
+out:
+    /* Only a rewritten ACL needs to be logged */
+    if (saved && saved->data && (result == -1 || !shifted)) {
+        free(saved->data);
+        saved->data = NULL;
+        saved->shifted = NULL;
+        saved->len = 0;
+    }
+    if (buf != stackbuf) {
+        free(buf);
+    }
+    return result;
+}
+
+/* Write an ACL that shift_acl() kept back */
+static int acl_write(const file_ref_t *ref, const char *xattr, const acl_saved_t *acl) {
+    char pathbuf[PATH_MAX];
+    const char *path = NULL;
+    
+    if (ref->fd < 0) {
+        path = ref_acl_path(ref, pathbuf, sizeof(pathbuf));
+    }
+    return ref_setxattr(ref, path, xattr, acl->shifted, acl->len);
+}
+
+/* Whether an entry has the given ACL xattr, for the census */
+static int census_has_acl(convert_job_t *job, const file_ref_t *ref, const char *xattr) {
+    char pathbuf[PATH_MAX];
+    const char *path = NULL;
+    
+    if (__atomic_load_n(&job->no_acl, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    if (ref->fd < 0) {
+        path = ref_acl_path(ref, pathbuf, sizeof(pathbuf));
+    }
+    if (ref_getxattr(ref, path, xattr, NULL, 0) > 0) {
+        return 1;
+    }
+    if (errno == ENOTSUP || errno == ENOSYS) {
+        __atomic_store_n(&job->no_acl, 1, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+/* Count one entry instead of converting it */
+static int census_file(convert_job_t *job, const file_ref_t *ref, const struct stat *st) {
+    census_t *c = job->census;
+    uint32_t uid = st->st_uid < CENSUS_IDS ? st->st_uid : CENSUS_IDS;
+    uint32_t gid = st->st_gid < CENSUS_IDS ? st->st_gid : CENSUS_IDS;
+    
+    if (S_ISDIR(st->st_mode)) {
+        __atomic_add_fetch(&c->dirs, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&c->files, 1, __ATOMIC_RELAXED);
+        if (st->st_nlink > 1) {
+            __atomic_add_fetch(&c->hardlinked, 1, __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_add_fetch(&c->uid_class[id_class(job->map, st->st_uid, 0)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->gid_class[id_class(job->map, st->st_gid, 1)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->uid_hist[uid], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->gid_hist[gid], 1, __ATOMIC_RELAXED);
+    
+    if (!S_ISLNK(st->st_mode)) {
+        if (census_has_acl(job, ref, ACL_XATTR_ACCESS)) {
+            __atomic_add_fetch(&c->acl_access, 1, __ATOMIC_RELAXED);
+        }
+        if (S_ISDIR(st->st_mode) && census_has_acl(job, ref, ACL_XATTR_DEFAULT)) {
+            __atomic_add_fetch(&c->acl_default, 1, __ATOMIC_RELAXED);
+        }
+    }
+    
+    __atomic_add_fetch(&job->files_processed, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * Verification (--verify, --verify-sample): after converting, the walker
+ * runs once more over the filesystems, read-only. Every entry's owner and
+ * the ids in its ACLs must be in the target range; anything else is an
+ * error listed in the job's report. A sample only checks the entries of
+ * the chosen directories and lists the others just to find subdirectories.
+ */
+static int verify_sampled(uint64_t ino) {
+    uint64_t h = (ino ^ g_verify_seed) * 0x9E3779B97F4A7C15ULL;
+    
+    return g_verify >= 100 || (double)(h >> 11) < g_verify / 100 * (double)(1ULL << 53);
+}
+
+/* Check the ids in an ACL xattr, 0 if it has none outside the target range */
+static int verify_acl(convert_job_t *job, const file_ref_t *ref, const char *xattr) {
+    uint32_t buf[ACL_XATTR_BUF_SIZE / sizeof(uint32_t)];
+    char pathbuf[PATH_MAX];
+    const char *path = NULL;
+    ssize_t size;
+    
+    if (__atomic_load_n(&job->no_acl, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    if (ref->fd < 0) {
+        path = ref_acl_path(ref, pathbuf, sizeof(pathbuf));
+    }
+    size = ref_getxattr(ref, path, xattr, buf, sizeof(buf));
+    if (size == -1) {
+        if (errno == ENOTSUP || errno == ENOSYS) {
+            __atomic_store_n(&job->no_acl, 1, __ATOMIC_RELAXED);
+        }
+        if (errno == ERANGE) {
+            job_reportf(job, "%s (%s too large to check)", ref->path, xattr);
+            return -1;
+        }
+        return 0;
+    }
+    
+    acl_xattr_entry_t *entries = (acl_xattr_entry_t *)(buf + 1);
+    size_t count = size > (ssize_t)sizeof(uint32_t) ?
+                   (size - sizeof(uint32_t)) / sizeof(acl_xattr_entry_t) : 0;
+    
+    for (size_t i = 0; i < count; i++) {
+        uint32_t tag = le16toh(entries[i].e_tag);
+        uint32_t id = le32toh(entries[i].e_id);
+        
+        if ((tag == ACL_TAG_USER || tag == ACL_TAG_GROUP) &&
+            id_class(job->map, id, tag == ACL_TAG_GROUP) != ID_TARGET) {
+            job_reportf(job, "%s (%s %s %u)", ref->path,
+                        strcmp(xattr, ACL_XATTR_ACCESS) == 0 ? "ACL" : "default ACL",
+                        tag == ACL_TAG_GROUP ? "gid" : "uid", (unsigned)id);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Check one entry instead of converting it */
+static int verify_file(convert_job_t *job, const file_ref_t *ref, const struct stat *st) {
+    if (id_class(job->map, st->st_uid, 0) != ID_TARGET ||
+        id_class(job->map, st->st_gid, 1) != ID_TARGET) {
+        job_report(job, ref->path, st->st_uid, st->st_gid);
+    } else if (!S_ISLNK(st->st_mode) && verify_acl(job, ref, ACL_XATTR_ACCESS) == 0 &&
+               S_ISDIR(st->st_mode)) {
+        verify_acl(job, ref, ACL_XATTR_DEFAULT);
+    }
+    
+    __atomic_add_fetch(&job->files_processed, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * Specialised per-inode kernels. Whether the map is a single extent (the
+ * default +-100000, or one lxc.idmap range for uids and gids alike) and
+ * whether the job is idempotent hold for a whole run, so convert_file() is
+ * instantiated for each combination with the checks folded away; the
+ * direction is just the sign of the extent's delta. job_select_kernel()
+ * picks the instance, or the census or verify pass, once per job.
+ */
+static inline __attribute__((always_inline))
+uint32_t kernel_map(const id_mapping_t *m, uint32_t id, int is_gid, const int single) {
+    if (single) {
+        const id_extent_t *e = &m->uid.extents[0];
+        return id - e->first < e->count ? id + (e->target - e->first) : ID_UNMAPPED;
+    }
+    return id_map_lookup(is_gid ? &m->gid : &m->uid, id);
+}
+
+static inline __attribute__((always_inline))
+int kernel_class(const id_mapping_t *m, uint32_t id, int is_gid, const int single) {
+    if (single) {
+        const id_extent_t *e = &m->uid.extents[0];
+        int source = id - e->first < e->count;
+        
+        if (id - e->target < e->count && !(source && m->source_first)) {
+            return ID_TARGET;
+        }
+        return source ? ID_SOURCE : ID_OUT;
+    }
+    return id_class(m, id, is_gid);
+}
+
+/*
+ * Changes held back for the change log. A walker thread queues every
+ * logged entry instead of changing it; when CHANGE_BATCH entries or
+ * CHANGE_BATCH_DIRS directories' own changes are queued, and before the
+ * thread waits for work, it syncs the log and then applies the queue
+ * (change_commit()), so nothing is changed that a killed run or a power
+ * cut could leave out of the log, at one sync per batch. Their jobs count
+ * them as pending work.
+ *
+ * A queued change holds a reference on the open directory it addresses:
+ * the one holding the entry, or a directory itself. A directory's subtree
+ * therefore only finishes, and is journaled, once its own change and
+ * those of its entries are applied, and a failed one is counted as an
+ * error first. A run killed before the commit finds the directory not
+ * journaled and converts it again; one killed after the commit and before
+ * the journal record does the same in idempotent mode, which skips what
+ * was applied.
+ */
+#define CHANGE_BATCH 1024
+#define CHANGE_BATCH_DIRS 64
+#define CHANGE_BATCH_JOBS 4
+
+typedef struct {
+    convert_job_t *job;
+    struct walk_dir *dir;   /* Held open until the change is applied */
+    int self;               /* Changes dir itself rather than an entry in it */
+    size_t path_off;        /* Into the batch's names */
+    size_t name_off;
+    uid_t uid;
+    gid_t gid;
+    mode_t mode;
+    acl_saved_t acls[2];
+} change_t;
+
+typedef struct {
+    struct walk_worker *worker;
+    change_t *items;        /* CHANGE_BATCH, allocated on first use */
+    size_t count;
+    int dirs;               /* Changes with self set */
+    convert_job_t *jobs[CHANGE_BATCH_JOBS]; /* Each held pending once */
+    int num_jobs;
+    char *names;
+    size_t names_used;
+    size_t names_cap;
+} change_batch_t;
+
+static __thread change_batch_t *t_changes;
+
+static int change_defer(change_batch_t *b, convert_job_t *job, const file_ref_t *ref,
+                        uid_t uid, gid_t gid, mode_t mode, const acl_saved_t *acls);
+
+/*
+ * Change one entry whose ACLs are shifted: ACLs kept back by shift_acl()
+ * are written (and freed), then ownership and mode.
+ */
+static void change_apply(convert_job_t *job, const file_ref_t *ref, uid_t uid, gid_t gid,
+                         mode_t mode, acl_saved_t *acls) {
+    static const char *const xattrs[2] = { ACL_XATTR_ACCESS, ACL_XATTR_DEFAULT };
+    
+    for (int i = 0; acls && i < 2; i++) {
+        if (acls[i].data && acl_write(ref, xattrs[i], &acls[i]) == -1) {
+            walk_report(errno, "Warning: could not update %sACL for %s",
+                        i ? "default " : "", ref->path);
+        }
+        free(acls[i].data);
+    }
+    
+    /* Change ownership */
+    if (ref_chown(ref, uid, gid) == -1) {
+        walk_report(errno, "Error changing ownership of %s", ref->path);
+        job_error(job);
+        return; /* Continue anyway */
+    }
+    
+    /* Restore mode (chown may strip setuid/setgid, nothing else changes) */
+    if (!S_ISLNK(mode) && (mode & (S_ISUID | S_ISGID)) && ref_chmod(ref, mode & 07777) == -1) {
+        walk_report(errno, "Warning: could not restore mode for %s", ref->path);
+    }
+    
+    __atomic_add_fetch(&job->files_processed, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Process a single file/directory, sb is its stat without following symlinks.
+ * The caller has already skipped hardlinks to inodes processed before.
+ */
+static inline __attribute__((always_inline))
+int convert_file(convert_job_t *job, const file_ref_t *ref, const struct stat *sb,
+                 const int single, const int idempotent) {
+    const char *fpath = ref->path;
+    struct stat st = *sb;
+    uint32_t new_uid;
+    uint32_t new_gid;
+    acl_saved_t acls[2] = { { NULL, NULL, 0 }, { NULL, NULL, 0 } };
+    int logging = g_changelog_fd >= 0;
+    
+    /*
+     * Idempotent jobs, and resumed ones, skip what is converted already and
+     * leave out of range or half converted entries for the report.
+     */
+    if (idempotent) {
+        int uid_class = kernel_class(job->map, st.st_uid, 0, single);
+        int gid_class = kernel_class(job->map, st.st_gid, 1, single);
+        
+        if (uid_class == ID_TARGET && gid_class == ID_TARGET) {
+            __atomic_add_fetch(&job->skipped, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+        if (uid_class != ID_SOURCE || gid_class != ID_SOURCE) {
+            job_report(job, fpath, st.st_uid, st.st_gid);
+            return 0;
+        }
+    }
+    
+    /* Calculate new UIDs/GIDs, ids outside the map mean a wrong or converted tree */
+    new_uid = kernel_map(job->map, st.st_uid, 0, single);
+    new_gid = kernel_map(job->map, st.st_gid, 1, single);
+    if (new_uid == ID_UNMAPPED || new_gid == ID_UNMAPPED) {
+        if (job->offset < 0) {
+            walk_report(0, "Error: %s already privileged or not a container", fpath);
+        } else {
+            walk_report(0, "Error: %s already unprivileged", fpath);
+        }
+        job_error(job);
+        return 1; /* Stop traversal */
+    }
+    
+    /*
+     * For non-symlinks, update ACLs. They are written before the ownership
+     * changes, so an entry with shifted ownership is complete when a run is
+     * resumed.
+     */
+    if (!S_ISLNK(st.st_mode)) {
+        /* Update access ACL */
+        if (STATS_CALL(STATS_SHIFT_ACL, shift_acl(job, ref, ACL_XATTR_ACCESS,
+                                                  logging ? &acls[0] : NULL)) == -1) {
+            walk_report(errno, "Warning: could not update ACL for %s", fpath);
+        }
+        
+        /* Update default ACL for directories */
+        if (S_ISDIR(st.st_mode)) {
+            if (STATS_CALL(STATS_SHIFT_ACL, shift_acl(job, ref, ACL_XATTR_DEFAULT,
+                                                      logging ? &acls[1] : NULL)) == -1) {
+                walk_report(errno, "Warning: could not update default ACL for %s", fpath);
+            }
+        }
+    }
+    
+    /*
+     * Record the previous state. An entry that cannot be logged is not
+     * changed, a logged one waits until its record is on disk.
+     */
+    if (logging) {
+        if (changelog_entry(job, ref, &st, acls) == -1) {
+            free(acls[0].data);
+            free(acls[1].data);
+            return 0;
+        }
+        if (t_changes &&
+            change_defer(t_changes, job, ref, new_uid, new_gid, st.st_mode, acls) == 0) {
+            return 0;
+        }
+        
+        /* Cannot be queued, sync the log for it alone */
+        if (changelog_sync(t_log) == -1) {
+            walk_report(0, "Error: could not log %s, it is left unchanged", fpath);
+            job_error(job);
+            free(acls[0].data);
+            free(acls[1].data);
+            return 0;
+        }
+    }
+    
+    change_apply(job, ref, new_uid, new_gid, st.st_mode, logging ? acls : NULL);
+    return 0; /* Continue traversal */
+}
+
+#define CONVERT_KERNEL(name, single, idempotent) \
+    static uint32_t acl_ids_##name(const id_mapping_t *m, acl_xattr_entry_t *entries, \
+                                   size_t count, uint32_t *shifted) { \
+        return acl_shift_ids(m, entries, count, shifted, single, idempotent); \
+    } \
+    static int convert_##name(convert_job_t *job, const file_ref_t *ref, \
+                              const struct stat *st) { \
+        return convert_file(job, ref, st, single, idempotent); \
+    }
+
+CONVERT_KERNEL(mapped, 0, 0)
+CONVERT_KERNEL(mapped_idempotent, 0, 1)
+CONVERT_KERNEL(single, 1, 0)
+CONVERT_KERNEL(single_idempotent, 1, 1)
+
+/* Pick the kernels for a job, after its mode flags are final */
+static void job_select_kernel(convert_job_t *job) {
+    static const struct {
+        int (*process)(convert_job_t *, const file_ref_t *, const struct stat *);
+        uint32_t (*acl_ids)(const id_mapping_t *, acl_xattr_entry_t *, size_t, uint32_t *);
+    } kernels[2][2] = {
+        { { convert_mapped, acl_ids_mapped },
+          { convert_mapped_idempotent, acl_ids_mapped_idempotent } },
+        { { convert_single, acl_ids_single },
+          { convert_single_idempotent, acl_ids_single_idempotent } },
+    };
+    int single = job->map->single != 0, idempotent = job->idempotent != 0;
+    
+    job->process = kernels[single][idempotent].process;
+    job->acl_ids = kernels[single][idempotent].acl_ids;
+    if (job->census) {
+        job->process = census_file;
+    } else if (job->verify) {
+        job->process = verify_file;
+    }
+}
+
+static inline int process_file(convert_job_t *job, const file_ref_t *ref, const struct stat *sb) {
+    return job->process(job, ref, sb);
+}
+
+/*
+ * Minimal io_uring support (no liburing, so the static binary has no new
+ * dependencies). Each walker thread can own a ring used to stat listing
+ * entries in batches with IORING_OP_STATX; everything the ring cannot do
+ * (chown, chmod, ACLs) stays synchronous on the walker thread, which works
+ * on one batch while the next one is in flight. Needs Linux 5.6 or newer,
+ * older kernels fall back to plain statx() at runtime.
+ */
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} uring_t;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_close(uring_t *ring) {
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+static int uring_open(uring_t *ring, unsigned entries) {
+    struct io_uring_params params;
+    
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = sys_io_uring_setup(entries, &params);
+    if (ring->fd < 0) {
+        ring->fd = -1;
+        return -1;
+    }
+    
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        uring_close(ring);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            uring_close(ring);
+            return -1;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_close(ring);
+        return -1;
+    }
+    
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+/* Check that this kernel can set up a ring and run IORING_OP_STATX on it */
+static int uring_supported(void) {
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe;
+    uring_t ring;
+    int supported = 0;
+    
+    if (uring_open(&ring, 2) == -1) {
+        return 0;
+    }
+    probe = calloc(1, probe_size);
+    if (probe && sys_io_uring_register(ring.fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+        supported = probe->last_op >= IORING_OP_STATX &&
+                    (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    uring_close(&ring);
+    return supported;
+}
+
+/* Queue a statx of name relative to dirfd, the ring always has room for a full batch */
+static void uring_prep_statx(uring_t *ring, int dirfd, const char *name,
+                             struct statx *stx, uint64_t user_data) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = dirfd;
+    sqe->addr = (uint64_t)(uintptr_t)name;
+    sqe->len = STAT_MASK;
+    sqe->off = (uint64_t)(uintptr_t)stx;
+    sqe->statx_flags = AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Parallel directory walker
+ *
+ * Each worker owns a deque of directories whose entries still have to be
+ * processed. Workers push newly found subdirectories onto the bottom of
+ * their own deque and pop from the bottom (depth first, good locality),
+ * idle workers steal from the top of other deques (the oldest and usually
+ * largest subtrees). Like nftw() with FTW_PHYS | FTW_MOUNT, symlinks are
+ * never followed and other filesystems are not entered. All paths of a
+ * conversion share one pool of workers; each item belongs to a job.
+ *
+ * Directories are opened relative to their parent's descriptor and their
+ * entries are handled relative to their own, so no syscall resolves a full
+ * path. A parent stays open while any of its subdirectories is queued,
+ * and is remembered until its whole subtree is done, for the journal.
+ *
+ * Listings are read with getdents64() into a large per-thread buffer and
+ * classified by d_type, so subdirectories are queued without a stat and
+ * every inode is stat'ed exactly once with a minimal statx() mask. With
+ * --io-uring those stats are submitted in two alternating batches.
+ */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct walk_dir {
+    int fd;             /* -1 once listed if handle is set */
+    int refs;           /* Users of fd: the listing, queued children and changes, atomic */
+    int subtree;        /* Unfinished: fd users and child directories, atomic */
+    int queued;         /* Changes of it or its entries not applied yet, atomic */
+    uint64_t ino;
+    struct walk_dir *up;
+    struct file_handle *handle; /* Past the open limit: children reopen it by handle */
+} walk_dir_t;
+
+typedef struct {
+    const char *name;   /* Points into the getdents64() buffer */
+    int res;            /* statx result, 0 or -errno */
+    int done;
+    struct statx stx;
+} uring_slot_t;
+
+typedef struct walk_item {
+    size_t size;        /* Allocation size, for slab_free() */
+    convert_job_t *job;
+    walk_dir_t *parent; /* NULL for the root and spilled items */
+    walk_dir_t *up;     /* Spilled items: parent, only its subtree is held */
+    int fd;             /* Spilled items: reopened by handle, or -1 */
+    int err;            /* Why fd is -1 */
+    size_t name_off;    /* Start of the last component in path */
+    char path[];
+} walk_item_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    walk_item_t **items;
+    size_t head;
+    size_t count;
+    size_t cap;
+} walk_deque_t;
+
+struct walker;
+
+typedef struct walk_worker {
+    struct walker *walker;
+    pthread_t thread;
+    int id;
+    walk_deque_t deque;
+    slab_t slab;        /* Walk items, released when the walk ends */
+    char *dentbuf;      /* DENTS_BUF_SIZE bytes for getdents64() */
+    uring_t *ring;      /* Set up on first use with --io-uring */
+    uring_slot_t slots[2][URING_BATCH];
+    int slot_count[2];
+    char *pathbuf;
+    size_t pathcap;
+    int credit;         /* Throttle tokens taken but not used yet */
+    changelog_buf_t log;
+    change_batch_t changes;
+    report_ring_t report;
+} walk_worker_t;
+
+typedef struct walker {
+    walk_worker_t *workers;
+    int num_workers;
+    convert_job_t *jobs;
+    int num_jobs;
+    pthread_mutex_t sched_lock; /* Guards job states */
+    uint64_t pending;   /* Items queued or being processed, all jobs */
+    int idle;           /* Workers waiting for work */
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    uint64_t queued;    /* Items in the deques, atomic */
+    int open_dirs;      /* Directory fds kept past their listing, atomic */
+    long max_open;
+    pthread_mutex_t spill_lock;
+    int spill_fd;       /* Unlinked temporary file, -1 until needed */
+    off_t spill_end;
+    uint64_t spilled;   /* Directories that went through the file */
+} walker_t;
+
+static int deque_push(walk_deque_t *dq, walk_item_t *item) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count == dq->cap) {
+        size_t new_cap = dq->cap ? dq->cap * 2 : 64;
+        walk_item_t **items = malloc(new_cap * sizeof(*items));
+        if (!items) {
+            pthread_mutex_unlock(&dq->lock);
+            return -1;
+        }
+        for (size_t i = 0; i < dq->count; i++) {
+            items[i] = dq->items[(dq->head + i) % dq->cap];
+        }
+        free(dq->items);
+        dq->items = items;
+        dq->head = 0;
+        dq->cap = new_cap;
+    }
+    dq->items[(dq->head + dq->count) % dq->cap] = item;
+    dq->count++;
+    pthread_mutex_unlock(&dq->lock);
+    return 0;
+}
+
+/* Owner end: newest item first */
+static walk_item_t *deque_pop(walk_deque_t *dq) {
+    walk_item_t *item = NULL;
+    
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count > 0) {
+        dq->count--;
+        item = dq->items[(dq->head + dq->count) % dq->cap];
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return item;
+}
+
+/* Thief end: oldest item first */
+static walk_item_t *deque_steal(walk_deque_t *dq) {
+    walk_item_t *item = NULL;
+    
+    if (__atomic_load_n(&dq->count, __ATOMIC_RELAXED) == 0) {
+        return NULL;
+    }
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count > 0) {
+        item = dq->items[dq->head];
+        dq->head = (dq->head + 1) % dq->cap;
+        dq->count--;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return item;
+}
+
+/*
+ * Finish part of a directory's subtree. When nothing is left, the subtree
+ * is journaled, unless the job has seen errors or stopped, whose effects
+ * on this subtree are all visible here, and the parent is told in turn.
+ * Queued changes hold the directory, so none can be left at this point;
+ * if one were, journaling would record a change that may never be made.
+ */
+static void walk_subtree_put(walk_worker_t *worker, convert_job_t *job, walk_dir_t *dir) {
+    while (dir && __atomic_sub_fetch(&dir->subtree, 1, __ATOMIC_ACQ_REL) == 0) {
+        walk_dir_t *up = dir->up;
+        
+        if (__atomic_load_n(&dir->queued, __ATOMIC_ACQUIRE) != 0) {
+            walk_report(0, "Internal error: directory finished with changes queued");
+            job_error(job);
+        }
+        if (__atomic_load_n(&job->errors, __ATOMIC_RELAXED) == 0 &&
+            !__atomic_load_n(&job->abort, __ATOMIC_RELAXED)) {
+            journal_record(job, dir->ino);
+        }
+        slab_free(&worker->slab, dir, sizeof(walk_dir_t));
+        dir = up;
+    }
+}
+
+/* Drop a reference to an open directory, closing it with the last one */
+static void walk_dir_put(walk_worker_t *worker, convert_job_t *job, walk_dir_t *dir) {
+    if (dir && __atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (dir->fd >= 0) {
+            close(dir->fd);
+            __atomic_sub_fetch(&worker->walker->open_dirs, 1, __ATOMIC_RELAXED);
+        }
+        free(dir->handle);
+        walk_subtree_put(worker, job, dir);
+    }
+}
+
+static void job_finish(walk_worker_t *worker, convert_job_t *job);
+
+/* Sync the log, then apply the changes queued since the last time */
+static void change_commit(change_batch_t *b) {
+    walk_worker_t *worker = b->worker;
+    walker_t *w = worker->walker;
+    int logged = changelog_sync(t_log) == 0;
+    
+    for (size_t i = 0; i < b->count; i++) {
+        change_t *c = &b->items[i];
+        file_ref_t ref = { c->self ? c->dir->fd : -1, c->self ? -1 : c->dir->fd,
+                           b->names + c->name_off, b->names + c->path_off, c->dir };
+        
+        if (logged) {
+            change_apply(c->job, &ref, c->uid, c->gid, c->mode, c->acls);
+        } else {
+            walk_report(0, "Error: could not log %s, it is left unchanged", ref.path);
+            job_error(c->job);
+            free(c->acls[0].data);
+            free(c->acls[1].data);
+        }
+        __atomic_sub_fetch(&c->dir->queued, 1, __ATOMIC_RELEASE);
+        walk_dir_put(worker, c->job, c->dir);
+    }
+    b->count = 0;
+    b->dirs = 0;
+    b->names_used = 0;
+    
+    for (int i = 0; i < b->num_jobs; i++) {
+        convert_job_t *job = b->jobs[i];
+        
+        if (__atomic_sub_fetch(&job->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+            pthread_mutex_lock(&w->sched_lock);
+            job_finish(worker, job);
+            pthread_mutex_unlock(&w->sched_lock);
+        }
+        __atomic_sub_fetch(&w->pending, 1, __ATOMIC_SEQ_CST);
+    }
+    b->num_jobs = 0;
+}
+
+/* Queue a logged change, -1 if it cannot wait and has to be applied now */
+static int change_defer(change_batch_t *b, convert_job_t *job, const file_ref_t *ref,
+                        uid_t uid, gid_t gid, mode_t mode, const acl_saved_t *acls) {
+    size_t path_len = strlen(ref->path) + 1;
+    size_t name_len = ref->fd >= 0 ? 1 : strlen(ref->name) + 1;
+    int held = 0;
+    change_t *c;
+    
+    if (!ref->dir) {
+        return -1;
+    }
+    if (!b->items && !(b->items = malloc(CHANGE_BATCH * sizeof(change_t)))) {
+        return -1;
+    }
+    if (b->names_used + path_len + name_len > b->names_cap) {
+        size_t cap = b->names_cap ? b->names_cap : 64 * 1024;
+        char *names;
+        
+        while (cap < b->names_used + path_len + name_len) {
+            cap *= 2;
+        }
+        if (!(names = realloc(b->names, cap))) {
+            return -1;
+        }
+        b->names = names;
+        b->names_cap = cap;
+    }
+    for (int i = 0; i < b->num_jobs; i++) {
+        held |= b->jobs[i] == job;
+    }
+    if (!held && b->num_jobs == CHANGE_BATCH_JOBS) {
+        change_commit(b);
+    }
+    
+    c = &b->items[b->count];
+    c->dir = ref->dir;
+    c->self = ref->fd >= 0;
+    b->dirs += c->self;
+    __atomic_add_fetch(&c->dir->refs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->dir->queued, 1, __ATOMIC_RELAXED);
+    if (!held) {
+        /* Until the queue is applied the job is not done */
+        __atomic_add_fetch(&job->pending, 1, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&b->worker->walker->pending, 1, __ATOMIC_SEQ_CST);
+        b->jobs[b->num_jobs++] = job;
+    }
+    c->job = job;
+    c->uid = uid;
+    c->gid = gid;
+    c->mode = mode;
+    memcpy(c->acls, acls, sizeof(c->acls));
+    c->path_off = b->names_used;
+    memcpy(b->names + b->names_used, ref->path, path_len);
+    b->names_used += path_len;
+    c->name_off = b->names_used;
+    memcpy(b->names + b->names_used, ref->fd >= 0 ? "" : ref->name, name_len);
+    b->names_used += name_len;
+    
+    if (++b->count == CHANGE_BATCH || b->dirs >= CHANGE_BATCH_DIRS) {
+        change_commit(b);
+    }
+    return 0;
+}
+
+/*
+ * Metadata prefetch (--prefetch). Every directory a walker queues is also
+ * offered to a few prefetch threads, which list it and stat its entries
+ * with AT_STATX_DONT_SYNC. On a cold cache that reads the inodes (ZFS
+ * dnodes) while the walkers are busy elsewhere, so a walker reaching the
+ * directory finds them cached. Walkers take the directory they queued
+ * last, so the prefetch queue is a stack too, and when it is full the
+ * oldest directory is dropped: it would be warmed too late. A queued
+ * directory is a duplicate of its parent's fd and its name, opened with
+ * O_NOFOLLOW and dropped if it is on another filesystem, so no path is
+ * resolved twice. Prefetching is only a hint, nothing it sees is used.
+ */
+typedef struct {
+    int fd;                 /* Duplicate of the parent's fd */
+    dev_t dev;              /* Filesystem of the walk */
+    char name[NAME_MAX + 1];
+} prefetch_dir_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    prefetch_dir_t dirs[PREFETCH_QUEUE]; /* Circular, newest at top - 1 */
+    unsigned top, count;
+    int stop;
+    pthread_t threads[MAX_PREFETCH];
+    int num_threads;
+} prefetch_t;
+
+static prefetch_t prefetch = { .lock = PTHREAD_MUTEX_INITIALIZER,
+                               .cond = PTHREAD_COND_INITIALIZER };
+
+static void prefetch_push(int dirfd, const char *name, dev_t dev) {
+    size_t len = strlen(name);
+    prefetch_dir_t *d;
+    int old = -1;
+    int fd;
+    
+    if (len > NAME_MAX || (fd = fcntl(dirfd, F_DUPFD_CLOEXEC, 0)) == -1) {
+        return;
+    }
+    pthread_mutex_lock(&prefetch.lock);
+    if (prefetch.count == PREFETCH_QUEUE) {
+        old = prefetch.dirs[(prefetch.top + PREFETCH_QUEUE - prefetch.count) % PREFETCH_QUEUE].fd;
+        prefetch.count--;
+    }
+    d = &prefetch.dirs[prefetch.top];
+    d->fd = fd;
+    d->dev = dev;
+    memcpy(d->name, name, len + 1);
+    prefetch.top = (prefetch.top + 1) % PREFETCH_QUEUE;
+    prefetch.count++;
+    pthread_cond_signal(&prefetch.cond);
+    pthread_mutex_unlock(&prefetch.lock);
+    if (old != -1) {
+        close(old);
+    }
+}
+
+static void prefetch_dir(const prefetch_dir_t *d, char *buf) {
+    int fd = openat(d->fd, d->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    struct stat st;
+    long nread;
+    
+    if (fd == -1) {
+        return;
+    }
+    if (fstat(fd, &st) == -1 || st.st_dev != d->dev) {
+        close(fd);
+        return;
+    }
+    while ((nread = syscall(SYS_getdents64, fd, buf, PREFETCH_BUF_SIZE)) > 0) {
+        for (long pos = 0; pos < nread; ) {
+            struct linux_dirent64 *de = (struct linux_dirent64 *)(buf + pos);
+            struct statx stx;
+            
+            pos += de->d_reclen;
+            if (de->d_name[0] == '.' && (de->d_name[1] == '\0' ||
+                                         (de->d_name[1] == '.' && de->d_name[2] == '\0'))) {
+                continue;
+            }
+            statx(fd, de->d_name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT | AT_STATX_DONT_SYNC,
+                  STAT_MASK, &stx);
+        }
+    }
+    close(fd);
+}
+
+static void *prefetch_thread(void *arg) {
+    char *buf = malloc(PREFETCH_BUF_SIZE);
+    
+    (void)arg;
+    if (g_background) {
+        background_thread();
+    }
+    pthread_mutex_lock(&prefetch.lock);
+    while (buf && !prefetch.stop) {
+        prefetch_dir_t d;
+        
+        if (prefetch.count == 0) {
+            pthread_cond_wait(&prefetch.cond, &prefetch.lock);
+            continue;
+        }
+        prefetch.top = (prefetch.top + PREFETCH_QUEUE - 1) % PREFETCH_QUEUE;
+        prefetch.count--;
+        d = prefetch.dirs[prefetch.top];
+        pthread_mutex_unlock(&prefetch.lock);
+        prefetch_dir(&d, buf);
+        close(d.fd);
+        pthread_mutex_lock(&prefetch.lock);
+    }
+    pthread_mutex_unlock(&prefetch.lock);
+    free(buf);
+    return NULL;
+}
+
+static void prefetch_start(void) {
+    prefetch.stop = 0;
+    prefetch.num_threads = 0;
+    for (int i = 0; i < g_prefetch; i++) {
+        if (pthread_create(&prefetch.threads[i], NULL, prefetch_thread, NULL) != 0) {
+            break;
+        }
+        prefetch.num_threads++;
+    }
+}
+
+static void prefetch_stop(void) {
+    pthread_mutex_lock(&prefetch.lock);
+    prefetch.stop = 1;
+    pthread_cond_broadcast(&prefetch.cond);
+    pthread_mutex_unlock(&prefetch.lock);
+    for (int i = 0; i < prefetch.num_threads; i++) {
+        pthread_join(prefetch.threads[i], NULL);
+    }
+    prefetch.num_threads = 0;
+    for (; prefetch.count > 0; prefetch.count--) {
+        prefetch.top = (prefetch.top + PREFETCH_QUEUE - 1) % PREFETCH_QUEUE;
+        close(prefetch.dirs[prefetch.top].fd);
+    }
+}
+
+/*
+ * Queue spill. Past g_max_queue directories in the deques, a directory
+ * being queued is written to an unlinked file as its file handle and path
+ * instead, so a directory with millions of subdirectories costs disk, not
+ * memory. The record holds no fd, only the parent's subtree, so journaling
+ * still waits for it. Idle walkers read records back newest first, which
+ * keeps the walk depth-first.
+ */
+typedef struct {
+    uint32_t size;              /* Whole record, also repeated after it */
+    uint32_t job;
+    uint64_t up;                /* walk_dir_t of the parent */
+    int32_t handle_type;
+    uint32_t handle_bytes;
+    uint32_t path_len;
+    uint32_t name_off;
+} spill_rec_t;
+
+static int spill_push(walk_worker_t *worker, convert_job_t *job, walk_dir_t *parent,
+                      const char *path, size_t name_off) {
+    walker_t *w = worker->walker;
+    union {
+        struct file_handle fh;
+        char buf[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+    } handle;
+    char rec[sizeof(spill_rec_t) + MAX_HANDLE_SZ + PATH_MAX + 2 * sizeof(uint32_t)];
+    spill_rec_t *hdr = (spill_rec_t *)rec;
+    size_t path_len = strlen(path);
+    size_t size;
+    int mount_id;
+    int result = -1;
+    
+    handle.fh.handle_bytes = MAX_HANDLE_SZ;
+    if (path_len >= PATH_MAX ||
+        name_to_handle_at(parent->fd, path + name_off, &handle.fh, &mount_id, 0) == -1) {
+        return -1;
+    }
+    size = (sizeof(*hdr) + handle.fh.handle_bytes + path_len + sizeof(uint32_t) + 7) & ~(size_t)7;
+    hdr->size = (uint32_t)size;
+    hdr->job = (uint32_t)(job - w->jobs);
+    hdr->up = (uint64_t)(uintptr_t)parent;
+    hdr->handle_type = handle.fh.handle_type;
+    hdr->handle_bytes = handle.fh.handle_bytes;
+    hdr->path_len = (uint32_t)path_len;
+    hdr->name_off = (uint32_t)name_off;
+    memcpy(rec + sizeof(*hdr), handle.fh.f_handle, handle.fh.handle_bytes);
+    memcpy(rec + sizeof(*hdr) + handle.fh.handle_bytes, path, path_len);
+    memcpy(rec + size - sizeof(uint32_t), &hdr->size, sizeof(uint32_t));
+    
+    pthread_mutex_lock(&w->spill_lock);
+    if (w->spill_fd == -1) {
+        w->spill_fd = open(SPILL_DIR, O_TMPFILE | O_RDWR | O_EXCL | O_CLOEXEC, 0600);
+    }
+    if (w->spill_fd >= 0 && pwrite(w->spill_fd, rec, size, w->spill_end) == (ssize_t)size) {
+        w->spill_end += size;
+        w->spilled++;
+        __atomic_add_fetch(&parent->subtree, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&job->pending, 1, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&w->pending, 1, __ATOMIC_SEQ_CST);
+        result = 0;
+    }
+    pthread_mutex_unlock(&w->spill_lock);
+    return result;
+}
+
+/* Take the newest spilled directory, reopened by its handle */
+static walk_item_t *spill_pop(walk_worker_t *worker) {
+    walker_t *w = worker->walker;
+    union {
+        struct file_handle fh;
+        char buf[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+    } handle;
+    char rec[sizeof(spill_rec_t) + MAX_HANDLE_SZ + PATH_MAX + 2 * sizeof(uint32_t)];
+    spill_rec_t *hdr = (spill_rec_t *)rec;
+    walk_item_t *item;
+    uint32_t size;
+    
+    if (__atomic_load_n(&w->spilled, __ATOMIC_RELAXED) == 0) {
+        return NULL;
+    }
+    pthread_mutex_lock(&w->spill_lock);
+    if (w->spill_end == 0 ||
+        pread(w->spill_fd, &size, sizeof(size), w->spill_end - sizeof(size)) != sizeof(size) ||
+        size > sizeof(rec) || pread(w->spill_fd, rec, size, w->spill_end - size) != size) {
+        pthread_mutex_unlock(&w->spill_lock);
+        return NULL;
+    }
+    w->spill_end -= size;
+    pthread_mutex_unlock(&w->spill_lock);
+    
+    item = slab_alloc(&worker->slab, sizeof(walk_item_t) + hdr->path_len + 1);
+    if (!item) {
+        /* Nothing to walk it with, the job ends with an error */
+        convert_job_t *job = &w->jobs[hdr->job];
+        
+        walk_report(0, "Failed to allocate memory for a spilled directory");
+        job_error(job);
+        walk_subtree_put(worker, job, (walk_dir_t *)(uintptr_t)hdr->up);
+        __atomic_sub_fetch(&job->pending, 1, __ATOMIC_SEQ_CST);
+        __atomic_sub_fetch(&w->pending, 1, __ATOMIC_SEQ_CST);
+        return NULL;
+    }
+    item->size = sizeof(walk_item_t) + hdr->path_len + 1;
+    item->job = &w->jobs[hdr->job];
+    item->parent = NULL;
+    item->up = (walk_dir_t *)(uintptr_t)hdr->up;
+    item->name_off = hdr->name_off;
+    memcpy(item->path, rec + sizeof(*hdr) + hdr->handle_bytes, hdr->path_len);
+    item->path[hdr->path_len] = '\0';
+    
+    handle.fh.handle_type = hdr->handle_type;
+    handle.fh.handle_bytes = hdr->handle_bytes;
+    memcpy(handle.fh.f_handle, rec + sizeof(*hdr), hdr->handle_bytes);
+    item->fd = open_by_handle_at(item->job->mount_fd, &handle.fh,
+                                 O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    item->err = errno;
+    return item;
+}
+
+/* Queue a directory for processing on the given worker */
+static int walker_push(walk_worker_t *worker, convert_job_t *job, walk_dir_t *parent,
+                       const char *path, size_t name_off) {
+    walker_t *w = worker->walker;
+    size_t size = sizeof(walk_item_t) + strlen(path) + 1;
+    walk_item_t *item;
+    
+    if (parent && job->mount_fd >= 0 &&
+        __atomic_load_n(&w->queued, __ATOMIC_RELAXED) >= (uint64_t)g_max_queue &&
+        spill_push(worker, job, parent, path, name_off) == 0) {
+        return 0;
+    }
+    item = slab_alloc(&worker->slab, size);
+    if (!item) {
+        return -1;
+    }
+    item->size = size;
+    item->job = job;
+    item->parent = parent;
+    item->up = NULL;
+    item->fd = -1;
+    item->name_off = name_off;
+    memcpy(item->path, path, size - sizeof(walk_item_t));
+    if (parent) {
+        __atomic_add_fetch(&parent->refs, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&job->pending, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&w->pending, 1, __ATOMIC_SEQ_CST);
+    if (deque_push(&worker->deque, item) == -1) {
+        __atomic_sub_fetch(&w->pending, 1, __ATOMIC_SEQ_CST);
+        __atomic_sub_fetch(&job->pending, 1, __ATOMIC_SEQ_CST);
+        walk_dir_put(worker, job, parent);
+        slab_free(&worker->slab, item, size);
+        return -1;
+    }
+    __atomic_add_fetch(&w->queued, 1, __ATOMIC_RELAXED);
+    if (prefetch.num_threads > 0 && parent && parent->fd >= 0) {
+        prefetch_push(parent->fd, path + name_off, job->dev);
+    }
+    if (__atomic_load_n(&w->idle, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&w->idle_lock);
+        pthread_cond_signal(&w->idle_cond);
+        pthread_mutex_unlock(&w->idle_lock);
+    }
+    return 0;
+}
+
+/* Find work for a worker: own deque first, then steal, then wait */
+static walk_item_t *walker_next(walk_worker_t *worker) {
+    walker_t *w = worker->walker;
+    walk_item_t *item;
+    
+    for (;;) {
+        if ((item = deque_pop(&worker->deque))) {
+            __atomic_sub_fetch(&w->queued, 1, __ATOMIC_RELAXED);
+            return item;
+        }
+        for (int i = 1; i < w->num_workers; i++) {
+            walk_worker_t *victim = &w->workers[(worker->id + i) % w->num_workers];
+            if ((item = deque_steal(&victim->deque))) {
+                __atomic_sub_fetch(&w->queued, 1, __ATOMIC_RELAXED);
+                return item;
+            }
+        }
+        if ((item = spill_pop(worker))) {
+            return item;
+        }
+        
+        /* Queued changes keep their jobs pending, never wait on them */
+        if (worker->changes.count > 0) {
+            change_commit(&worker->changes);
+            continue;
+        }
+        
+        /* Nothing to do: finished when no items are queued or in flight */
+        pthread_mutex_lock(&w->idle_lock);
+        if (__atomic_load_n(&w->pending, __ATOMIC_SEQ_CST) == 0) {
+            pthread_cond_broadcast(&w->idle_cond);
+            pthread_mutex_unlock(&w->idle_lock);
+            return NULL;
+        }
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 10 * 1000 * 1000;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        __atomic_add_fetch(&w->idle, 1, __ATOMIC_SEQ_CST);
+        pthread_cond_timedwait(&w->idle_cond, &w->idle_lock, &ts);
+        __atomic_sub_fetch(&w->idle, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&w->idle_lock);
+    }
+}
+
+/* Build "dir/name" in the worker's path buffer, name_off receives where name starts */
+static const char *worker_path(walk_worker_t *worker, const char *dir, const char *name,
+                               size_t *name_off) {
+    size_t dlen = strlen(dir);
+    size_t nlen = strlen(name);
+    size_t need = dlen + nlen + 2;
+    
+    if (need > worker->pathcap) {
+        char *buf = realloc(worker->pathbuf, need);
+        if (!buf) {
+            return NULL;
+        }
+        worker->pathbuf = buf;
+        worker->pathcap = need;
+    }
+    memcpy(worker->pathbuf, dir, dlen);
+    if (dlen == 0 || dir[dlen - 1] != '/') {
+        worker->pathbuf[dlen++] = '/';
+    }
+    memcpy(worker->pathbuf + dlen, name, nlen + 1);
+    *name_off = dlen;
+    return worker->pathbuf;
+}
+
+/* Handle one listing entry, st is NULL for entries known to be directories */
+static void walk_entry(walk_worker_t *worker, walk_item_t *item, walk_dir_t *wd,
+                       const char *name, const struct stat *st) {
+    convert_job_t *job = item->job;
+    const char *fpath;
+    size_t name_off;
+    
+    fpath = worker_path(worker, item->path, name, &name_off);
+    if (!fpath) {
+        walk_report(0, "Failed to allocate path for %s/%s", item->path, name);
+        job_error(job);
+        return;
+    }
+    
+    /* Directories are stat'ed and converted once they are opened */
+    if (!st || S_ISDIR(st->st_mode)) {
+        if (walker_push(worker, job, wd, fpath, name_off) == -1) {
+            walk_report(0, "Failed to queue directory %s", fpath);
+            job_error(job);
+        }
+        return;
+    }
+    
+    /* Do not cross into other filesystems */
+    if (st->st_dev != job->dev) {
+        return;
+    }
+    
+    /* Only inodes with several links can be reached twice */
+    if (st->st_nlink > 1 && inode_test_and_mark(st->st_dev, st->st_ino)) {
+        if (job->census) {
+            __atomic_add_fetch(&job->census->extra_links, 1, __ATOMIC_RELAXED);
+        }
+        return; /* Skip hardlinks we've already processed */
+    }
+    
+    file_ref_t entry = { -1, wd->fd, name, fpath, wd };
+    throttle_take(&worker->credit);
+    if (process_file(job, &entry, st) != 0) {
+        __atomic_store_n(&job->abort, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void walk_stat_error(walk_worker_t *worker, walk_item_t *item, const char *name,
+                            int err) {
+    size_t name_off;
+    const char *fpath = worker_path(worker, item->path, name, &name_off);
+    
+    walk_report(err, "Error stating %s", fpath ? fpath : name);
+    job_error(item->job);
+}
+
+/* Submit the statx batch in the given bank of slots */
+static void walk_uring_submit(walk_worker_t *worker, walk_dir_t *wd, int bank) {
+    int count = worker->slot_count[bank];
+    int submitted;
+    
+    for (int i = 0; i < count; i++) {
+        uring_slot_t *slot = &worker->slots[bank][i];
+        slot->done = 0;
+        uring_prep_statx(worker->ring, wd->fd, slot->name, &slot->stx,
+                         (uint64_t)(bank * URING_BATCH + i));
+    }
+    submitted = STATS_CALL(STATS_URING, sys_io_uring_enter(worker->ring->fd, count, 0, 0));
+    if (submitted < count) {
+        /* Whatever the ring did not take is stat'ed synchronously on completion */
+        for (int i = submitted < 0 ? 0 : submitted; i < count; i++) {
+            worker->slots[bank][i].res = -EAGAIN;
+            worker->slots[bank][i].done = 1;
+        }
+        __atomic_store_n(worker->ring->sq_tail, *worker->ring->sq_head, __ATOMIC_RELEASE);
+    }
+}
+
+/* Wait for a submitted bank to complete and process its entries in listing order */
+static void walk_uring_complete(walk_worker_t *worker, walk_item_t *item, walk_dir_t *wd,
+                                int bank) {
+    uring_t *ring = worker->ring;
+    int count = worker->slot_count[bank];
+    
+    for (int i = 0; i < count; i++) {
+        uring_slot_t *slot = &worker->slots[bank][i];
+        
+        while (!slot->done) {
+            unsigned head = *ring->cq_head;
+            if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+                if (STATS_CALL(STATS_URING, sys_io_uring_enter(ring->fd, 0, 1,
+                                                               IORING_ENTER_GETEVENTS)) < 0 &&
+                    errno != EINTR) {
+                    slot->res = -EAGAIN;
+                    slot->done = 1;
+                }
+                continue;
+            }
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            uring_slot_t *done = &worker->slots[cqe->user_data / URING_BATCH]
+                                               [cqe->user_data % URING_BATCH];
+            done->res = cqe->res;
+            done->done = 1;
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+        }
+    }
+    
+    for (int i = 0; i < count && !__atomic_load_n(&item->job->abort, __ATOMIC_RELAXED); i++) {
+        uring_slot_t *slot = &worker->slots[bank][i];
+        struct stat st;
+        
+        if (slot->res == -EAGAIN) {
+            if (stat_at(wd->fd, slot->name, &st) == -1) {
+                walk_stat_error(worker, item, slot->name, errno);
+                continue;
+            }
+        } else if (slot->res < 0) {
+            walk_stat_error(worker, item, slot->name, -slot->res);
+            continue;
+        } else {
+            statx_to_stat(&slot->stx, &st);
+        }
+        walk_entry(worker, item, wd, slot->name, &st);
+    }
+    worker->slot_count[bank] = 0;
+}
+
+/*
+ * Process one getdents64() buffer. With dirs_only, entries known not to be
+ * directories are only counted.
+ */
+static void walk_entries(walk_worker_t *worker, walk_item_t *item, walk_dir_t *wd,
+                         long nread, int dirs_only) {
+    convert_job_t *job = item->job;
+    int bank = 0;
+    int in_flight = -1;     /* Bank submitted and not yet completed */
+    
+    for (long pos = 0; pos < nread && !__atomic_load_n(&job->abort, __ATOMIC_RELAXED); ) {
+        struct linux_dirent64 *de = (struct linux_dirent64 *)(worker->dentbuf + pos);
+        const char *name = de->d_name;
+        struct stat st;
+        
+        pos += de->d_reclen;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+        if (dirs_only && de->d_type != DT_DIR && de->d_type != DT_UNKNOWN) {
+            __atomic_add_fetch(&job->skipped, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (de->d_type == DT_DIR) {
+            walk_entry(worker, item, wd, name, NULL);
+            continue;
+        }
+        
+        if (!worker->ring) {
+            if (stat_at(wd->fd, name, &st) == -1) {
+                walk_stat_error(worker, item, name, errno);
+                continue;
+            }
+            walk_entry(worker, item, wd, name, &st);
+            continue;
+        }
+        
+        /* Fill a batch, then work on the previous one while this one is stat'ed */
+        worker->slots[bank][worker->slot_count[bank]++].name = name;
+        if (worker->slot_count[bank] == URING_BATCH) {
+            walk_uring_submit(worker, wd, bank);
+            if (in_flight >= 0) {
+                walk_uring_complete(worker, item, wd, in_flight);
+            }
+            in_flight = bank;
+            bank ^= 1;
+        }
+    }
+    
+    /* Names point into the buffer, so everything must finish before the next read */
+    if (worker->ring) {
+        if (worker->slot_count[bank] > 0 && !__atomic_load_n(&job->abort, __ATOMIC_RELAXED)) {
+            walk_uring_submit(worker, wd, bank);
+        } else {
+            worker->slot_count[bank] = 0;
+        }
+        if (in_flight >= 0) {
+            walk_uring_complete(worker, item, wd, in_flight);
+        }
+        if (worker->slot_count[bank] > 0) {
+            walk_uring_complete(worker, item, wd, bank);
+        }
+    }
+}
+
+/* File handle of an open directory, NULL if the filesystem has none */
+static struct file_handle *walk_dir_handle(int fd) {
+    struct file_handle *fh = malloc(sizeof(struct file_handle) + MAX_HANDLE_SZ);
+    int mount_id;
+    
+    if (fh) {
+        fh->handle_bytes = MAX_HANDLE_SZ;
+        if (name_to_handle_at(fd, "", fh, &mount_id, AT_EMPTY_PATH) == -1) {
+            free(fh);
+            fh = NULL;
+        }
+    }
+    return fh;
+}
+
+/* Open a queued directory, convert it and process all of its entries */
+static void walk_directory(walk_worker_t *worker, walk_item_t *item) {
+    convert_job_t *job = item->job;
+    const int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+    walk_dir_t *wd;
+    struct stat st;
+    int unchanged = 0;
+    long nread = 0;
+    int fd;
+    
+    if (item->up) {
+        fd = item->fd;
+        errno = item->err;
+    } else if (item->parent && item->parent->handle) {
+        /* The parent is closed, reopen it by handle for the lookup */
+        int pfd = STATS_CALL(STATS_OPEN, open_by_handle_at(job->mount_fd, item->parent->handle,
+                                                           O_PATH | O_DIRECTORY | O_CLOEXEC));
+        
+        fd = pfd == -1 ? -1 : STATS_CALL(STATS_OPEN, openat(pfd, item->path + item->name_off,
+                                                            flags));
+        if (pfd >= 0) {
+            int err = errno;
+            close(pfd);
+            errno = err;
+        }
+    } else if (item->parent) {
+        fd = STATS_CALL(STATS_OPEN, openat(item->parent->fd, item->path + item->name_off,
+                                           flags));
+    } else {
+        fd = STATS_CALL(STATS_OPEN, open(item->path, flags));
+    }
+    if (fd == -1) {
+        walk_report(errno, "Error opening directory %s", item->path);
+        job_error(job);
+        return;
+    }
+    
+    if (stat_at(fd, "", &st) == -1) {
+        walk_report(errno, "Error stating %s", item->path);
+        job_error(job);
+        close(fd);
+        return;
+    }
+    
+    /*
+     * Do not cross into other filesystems: a mount point only shows up when
+     * the directory is opened, and a directory reached twice (bind mount of
+     * the same filesystem) has been handled already.
+     */
+    if (st.st_dev != job->dev || inode_test_and_mark(st.st_dev, st.st_ino)) {
+        close(fd);
+        return;
+    }
+    
+    /* Converted completely by an interrupted run */
+    if (journal_done(job, st.st_ino)) {
+        close(fd);
+        return;
+    }
+    
+    /* Left out of the sample, only subdirectories need a look */
+    if (job->verify && !verify_sampled(st.st_ino)) {
+        unchanged = 1;
+    }
+    
+    if (!worker->dentbuf && !(worker->dentbuf = malloc(DENTS_BUF_SIZE))) {
+        walk_report(0, "Failed to allocate directory buffer");
+        job_error(job);
+        close(fd);
+        return;
+    }
+    wd = slab_alloc(&worker->slab, sizeof(walk_dir_t));
+    if (!wd) {
+        walk_report(0, "Failed to allocate memory for %s", item->path);
+        job_error(job);
+        close(fd);
+        return;
+    }
+    wd->fd = fd;
+    wd->refs = 1;
+    wd->subtree = 1;
+    wd->queued = 0;
+    wd->ino = st.st_ino;
+    wd->up = item->parent ? item->parent : item->up;
+    wd->handle = NULL;
+    
+    /* Past the limit the fd is closed after listing, children reopen the directory */
+    if (__atomic_add_fetch(&worker->walker->open_dirs, 1, __ATOMIC_RELAXED) >
+        worker->walker->max_open && job->mount_fd >= 0) {
+        wd->handle = walk_dir_handle(fd);
+        if (wd->handle) {
+            __atomic_sub_fetch(&worker->walker->open_dirs, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (wd->up) {
+        /* Taken while the item still holds the parent, so it cannot finish early */
+        __atomic_add_fetch(&wd->up->subtree, 1, __ATOMIC_RELAXED);
+    }
+    
+    /* A queued change of the directory itself holds wd like those of its entries */
+    file_ref_t ref = { fd, -1, NULL, item->path, wd };
+    if (unchanged) {
+        __atomic_add_fetch(&job->skipped, 1, __ATOMIC_RELAXED);
+    } else if (throttle_take(&worker->credit), process_file(job, &ref, &st) != 0) {
+        /* Stops the listing below, the subtree is not journaled */
+        __atomic_store_n(&job->abort, 1, __ATOMIC_RELAXED);
+    }
+    
+    if (g_io_uring && !worker->ring) {
+        uring_t *ring = malloc(sizeof(uring_t));
+        if (ring && uring_open(ring, 2 * URING_BATCH) == 0) {
+            worker->ring = ring;
+        } else {
+            free(ring);
+        }
+    }
+    
+    while (!__atomic_load_n(&job->abort, __ATOMIC_RELAXED) &&
+           (nread = STATS_CALL(STATS_GETDENTS, syscall(SYS_getdents64, fd, worker->dentbuf,
+                                                   DENTS_BUF_SIZE))) > 0) {
+        walk_entries(worker, item, wd, nread, unchanged);
+    }
+    if (nread == -1) {
+        walk_report(errno, "Error reading directory %s", item->path);
+        job_error(job);
+    }
+    
+    if (wd->handle) {
+        /* Queued changes of it and its entries need fd, they are the newest ones */
+        if (worker->changes.count > 0 &&
+            worker->changes.items[worker->changes.count - 1].dir == wd) {
+            change_commit(&worker->changes);
+        }
+        close(fd);
+        wd->fd = -1;
+    }
+    walk_dir_put(worker, job, wd);
+}
+
+/*
+ * Job scheduling: at most g_per_device jobs run at once on one device, so
+ * paths on different disks or pools are converted in parallel while paths
+ * sharing one do not compete for it. Called with sched_lock held.
+ */
+static void reporter_lock(void);
+static void reporter_unlock(void);
+static int reporter_running(void);
+
+static void schedule_jobs(walk_worker_t *worker) {
+    walker_t *w = worker->walker;
+    
+    for (int i = 0; i < w->num_jobs; i++) {
+        convert_job_t *job = &w->jobs[i];
+        int running = 0;
+        
+        if (job->state != JOB_WAITING) {
+            continue;
+        }
+        for (int k = 0; k < w->num_jobs; k++) {
+            running += w->jobs[k].state == JOB_RUNNING &&
+                       strcmp(w->jobs[k].device, job->device) == 0;
+        }
+        if (running >= g_per_device) {
+            continue;
+        }
+        
+        job->state = JOB_RUNNING;
+        clock_gettime(CLOCK_MONOTONIC, &job->start);
+        reporter_lock();
+        printf("\n%s: %s\n", job->census ? "Scanning" : job->verify ? "Verifying" : "Converting",
+               job->path);
+        fflush(stdout);
+        reporter_unlock();
+        
+        /* The root is queued without a parent and opened by its full path */
+        if (walker_push(worker, job, NULL, job->path, 0) == -1) {
+            walk_report(0, "Error: could not queue %s", job->path);
+            job_error(job);
+            job_finish(worker, job);
+        }
+    }
+}
+
+/* Report a job whose last item is done and start whatever it was holding up */
+static void job_finish(walk_worker_t *worker, convert_job_t *job) {
+    struct timespec now;
+    
+    /* Its messages come first, and the progress line is overwritten */
+    reporter_lock();
+    job->state = JOB_DONE;
+    job->result = job->errors > 0 ? -1 : 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    job->elapsed = (now.tv_sec - job->start.tv_sec) + (now.tv_nsec - job->start.tv_nsec) / 1e9;
+    printf("\rFinished %s: %"PRIu64" files (errors: %"PRIu64")    \n",
+           job->path, job->files_processed, job->errors);
+    if (job->skipped > 0) {
+        printf("  %"PRIu64" entries were %s\n", job->skipped,
+               job->verify ? "not in the sample" : "already converted");
+    }
+    fflush(stdout);
+    if (job->out_of_range > 0) {
+        if (job->verify) {
+            fprintf(stderr, "  %"PRIu64" entries have ids outside the target range:\n",
+                    job->out_of_range);
+        } else {
+            fprintf(stderr, "  %"PRIu64" entries have ids outside the source range and were "
+                    "left alone:\n", job->out_of_range);
+        }
+        for (int i = 0; i < REPORT_LIMIT && (uint64_t)i < job->out_of_range; i++) {
+            if (job->report[i]) {
+                fprintf(stderr, "    %s\n", job->report[i]);
+                free(job->report[i]);
+                job->report[i] = NULL;
+            }
+        }
+        if (job->out_of_range > REPORT_LIMIT) {
+            fprintf(stderr, "    ... and %"PRIu64" more\n", job->out_of_range - REPORT_LIMIT);
+        }
+    }
+    if (job->result == -1) {
+        fprintf(stderr, "Error %s %s\n", job->verify ? "verifying" : "converting", job->path);
+    }
+    fflush(stdout);
+    reporter_unlock();
+    schedule_jobs(worker);
+}
+
+static void *walker_thread(void *arg) {
+    walk_worker_t *worker = arg;
+    walker_t *w = worker->walker;
+    walk_item_t *item;
+    thread_stats_t *stats = t_stats;
+    changelog_buf_t *log = t_log;
+    change_batch_t *changes = t_changes;
+    report_ring_t *report = t_report;
+    
+    if (g_changelog_fd >= 0) {
+        t_log = &worker->log;
+        worker->changes.worker = worker;
+        t_changes = &worker->changes;
+    }
+    if (reporter_running()) {
+        t_report = &worker->report;
+    }
+    if (g_stats || throttle.max_latency_ns > 0) {
+        t_stats = &g_thread_stats[worker->id + 1];
+    }
+    if (g_background) {
+        background_thread();
+    }
+    while ((item = walker_next(worker))) {
+        convert_job_t *job = item->job;
+        
+        if (!__atomic_load_n(&job->abort, __ATOMIC_RELAXED)) {
+            walk_directory(worker, item);
+        } else if (item->fd >= 0) {
+            close(item->fd);
+        }
+        walk_dir_put(worker, job, item->parent);
+        walk_subtree_put(worker, job, item->up);
+        slab_free(&worker->slab, item, item->size);
+        
+        /* Next jobs are queued before this item stops counting, so nobody quits early */
+        if (__atomic_sub_fetch(&job->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+            pthread_mutex_lock(&w->sched_lock);
+            job_finish(worker, job);
+            pthread_mutex_unlock(&w->sched_lock);
+        }
+        __atomic_sub_fetch(&w->pending, 1, __ATOMIC_SEQ_CST);
+    }
+    if (worker->log.data) {
+        changelog_flush(&worker->log);
+        free(worker->log.data);
+        worker->log.data = NULL;
+    }
+    free(worker->changes.items);
+    free(worker->changes.names);
+    t_stats = stats;
+    t_log = log;
+    t_changes = changes;
+    t_report = report;
+    return NULL;
+}
+
+/* Directories stay open while their subdirectories are queued, allow as many as we may */
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/* Number of walker threads to start */
+static int walker_jobs(void) {
+    long n = g_jobs;
+    
+    if (n <= 0) {
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (n < 1) {
+        n = 1;
+    }
+    if (n > MAX_JOBS) {
+        n = MAX_JOBS;
+    }
+    return (int)n;
+}
+
+/*
+ * Reporter thread: drains the message rings of the walker threads every
+ * REPORTER_TICK_MS and prints a progress line with the entry rate and, when
+ * the total is known, an ETA, once a second on a terminal and every ten
+ * seconds otherwise. The total is the inode count of the filesystems, so
+ * it is only used when every path is the root of its own filesystem.
+ */
+#define REPORTER_TICK_MS 100
+
+typedef struct {
+    pthread_mutex_t lock;       /* Serializes draining and printing */
+    pthread_cond_t cond;
+    pthread_t thread;
+    int running, stop;
+    walker_t *walker;
+    report_kind_t kinds[REPORT_KINDS];
+    int num_kinds;
+    uint64_t dropped;
+    uint64_t total;             /* Entries expected, 0 if unknown */
+    int tty;
+    int progress_shown;         /* A progress line without newline is on screen */
+} reporter_t;
+
+static reporter_t reporter = { .lock = PTHREAD_MUTEX_INITIALIZER,
+                               .cond = PTHREAD_COND_INITIALIZER };
+
+static int reporter_running(void) {
+    return __atomic_load_n(&reporter.running, __ATOMIC_ACQUIRE);
+}
+
+/* End the progress line before anything else is printed */
+static void reporter_break_line(void) {
+    if (reporter.progress_shown) {
+        printf("\n");
+        fflush(stdout);
+        reporter.progress_shown = 0;
+    }
+}
+
+static report_kind_t *reporter_kind(const char *fmt, int err) {
+    for (int i = 0; i < reporter.num_kinds; i++) {
+        if (reporter.kinds[i].fmt == fmt && reporter.kinds[i].err == err) {
+            return &reporter.kinds[i];
+        }
+    }
+    if (reporter.num_kinds == REPORT_KINDS) {
+        return NULL;
+    }
+    report_kind_t *kind = &reporter.kinds[reporter.num_kinds++];
+    kind->fmt = fmt;
+    kind->err = err;
+    kind->count = 0;
+    kind->hidden = 0;
+    return kind;
+}
+
+static void reporter_emit(const report_msg_t *msg) {
+    report_kind_t *kind = reporter_kind(msg->fmt, msg->err);
+    
+    if (kind && ++kind->count > REPORT_REPEAT) {
+        kind->hidden++;
+        return;
+    }
+    reporter_break_line();
+    fprintf(stderr, msg->err ? "%s: %s\n" : "%s\n", msg->text, strerror(msg->err));
+    if (kind && kind->count == REPORT_REPEAT) {
+        fprintf(stderr, "  (more messages like this are only counted)\n");
+    }
+}
+
+/* Print what the walker threads queued, called with the lock held */
+static void reporter_drain(void) {
+    walker_t *w = reporter.walker;
+    
+    for (int i = 0; w && i < w->num_workers; i++) {
+        report_ring_t *ring = &w->workers[i].report;
+        uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        
+        while (ring->head != tail) {
+            reporter_emit(&ring->msgs[ring->head % REPORT_RING]);
+            __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+static void reporter_lock(void) {
+    pthread_mutex_lock(&reporter.lock);
+    reporter_drain();
+    reporter_break_line();
+}
+
+static void reporter_unlock(void) {
+    pthread_mutex_unlock(&reporter.lock);
+}
+
+/* Entries handled so far, converted or not */
+static uint64_t reporter_done(void) {
+    walker_t *w = reporter.walker;
+    uint64_t done = 0;
+    
+    for (int i = 0; i < w->num_jobs; i++) {
+        done += __atomic_load_n(&w->jobs[i].files_processed, __ATOMIC_RELAXED) +
+                __atomic_load_n(&w->jobs[i].skipped, __ATOMIC_RELAXED) +
+                __atomic_load_n(&w->jobs[i].out_of_range, __ATOMIC_RELAXED);
+    }
+    return done;
+}
+
+static void reporter_progress(uint64_t done, double rate) {
+    const convert_job_t *job = &reporter.walker->jobs[0];
+    const char *verb = job->census ? "Scanned" : job->verify ? "Verified" : "Processed";
+    
+    printf("%s%s %"PRIu64, reporter.tty ? "\r" : "", verb, done);
+    if (reporter.total > done) {
+        printf(" of ~%"PRIu64, reporter.total);
+    }
+    printf(" items, %.0f/s", rate);
+    if (reporter.total > done && rate > 0) {
+        uint64_t eta = (uint64_t)((reporter.total - done) / rate);
+        printf(", ETA %"PRIu64":%02"PRIu64, eta / 60, eta % 60);
+    }
+    printf(reporter.tty ? "    " : "\n");
+    fflush(stdout);
+    reporter.progress_shown = reporter.tty;
+}
+
+static void *reporter_thread(void *arg) {
+    uint64_t interval = (reporter.tty ? 1 : 10) * 1000000000ULL;
+    uint64_t last = stats_now(), last_done = 0;
+    double rate = 0;
+    
+    (void)arg;
+    pthread_mutex_lock(&reporter.lock);
+    while (!reporter.stop) {
+        struct timespec ts;
+        uint64_t now;
+        
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += REPORTER_TICK_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&reporter.cond, &reporter.lock, &ts);
+        reporter_drain();
+        
+        now = stats_now();
+        if (now - last >= interval && !reporter.stop) {
+            uint64_t done = reporter_done();
+            double current = (done - last_done) / ((now - last) / 1e9);
+            
+            /* Smoothed, the rate of one interval jumps with directory sizes */
+            rate = rate > 0 ? 0.7 * rate + 0.3 * current : current;
+            reporter_progress(done, rate);
+            last = now;
+            last_done = done;
+        }
+    }
+    pthread_mutex_unlock(&reporter.lock);
+    return NULL;
+}
+
+/* Inodes on the filesystems of the jobs, 0 if a path is not a filesystem root */
+static uint64_t reporter_estimate(const convert_job_t *jobs, int num_jobs) {
+    uint64_t total = 0;
+    
+    for (int i = 0; i < num_jobs; i++) {
+        char parent[MAX_PATH_LEN + 4];
+        struct stat st, up;
+        struct statvfs vfs;
+        int seen = 0;
+        
+        if (jobs[i].verify && g_verify < 100) {
+            return 0;
+        }
+        snprintf(parent, sizeof(parent), "%s/..", jobs[i].path);
+        if (stat(jobs[i].path, &st) == -1 || stat(parent, &up) == -1 ||
+            (st.st_dev == up.st_dev && st.st_ino != up.st_ino) ||
+            statvfs(jobs[i].path, &vfs) == -1 || vfs.f_files == 0) {
+            return 0;
+        }
+        for (int k = 0; k < i; k++) {
+            seen |= jobs[k].dev == jobs[i].dev;
+        }
+        if (!seen) {
+            total += vfs.f_files - vfs.f_ffree;
+        }
+    }
+    return total;
+}
+
+static void reporter_start(walker_t *w) {
+    reporter.walker = w;
+    reporter.stop = 0;
+    reporter.num_kinds = 0;
+    reporter.dropped = 0;
+    reporter.progress_shown = 0;
+    reporter.tty = isatty(STDOUT_FILENO);
+    reporter.total = reporter_estimate(w->jobs, w->num_jobs);
+    if (pthread_create(&reporter.thread, NULL, reporter_thread, NULL) == 0) {
+        __atomic_store_n(&reporter.running, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/* Print what is left and how many messages were only counted */
+static void reporter_stop(void) {
+    if (reporter_running()) {
+        pthread_mutex_lock(&reporter.lock);
+        reporter.stop = 1;
+        pthread_cond_signal(&reporter.cond);
+        pthread_mutex_unlock(&reporter.lock);
+        pthread_join(reporter.thread, NULL);
+        __atomic_store_n(&reporter.running, 0, __ATOMIC_RELEASE);
+    }
+    
+    pthread_mutex_lock(&reporter.lock);
+    reporter_drain();
+    reporter_break_line();
+    for (int i = 0; i < reporter.walker->num_workers; i++) {
+        report_ring_t *ring = &reporter.walker->workers[i].report;
+        
+        for (int k = 0; k < REPORT_OVERFLOW && ring->overflow[k].fmt; k++) {
+            report_kind_t *kind = reporter_kind(ring->overflow[k].fmt, ring->overflow[k].err);
+            
+            if (kind) {
+                kind->count += ring->overflow[k].count;
+                kind->hidden += ring->overflow[k].count;
+            } else {
+                reporter.dropped += ring->overflow[k].count;
+            }
+        }
+        reporter.dropped += ring->dropped;
+    }
+    for (int i = 0; i < reporter.num_kinds; i++) {
+        const report_kind_t *kind = &reporter.kinds[i];
+        const char *cut = strchr(kind->fmt, '%');
+        int len = cut ? (int)(cut - kind->fmt) : (int)strlen(kind->fmt);
+        
+        if (kind->hidden > 0) {
+            fprintf(stderr, "%"PRIu64" more messages \"%.*s...%s%s\"\n",
+                    kind->hidden, len, kind->fmt, kind->err ? ": " : "",
+                    kind->err ? strerror(kind->err) : "");
+        }
+    }
+    if (reporter.dropped > 0) {
+        fprintf(stderr, "%"PRIu64" other messages were not printed\n", reporter.dropped);
+    }
+    reporter.walker = NULL;
+    pthread_mutex_unlock(&reporter.lock);
+}
+
+/*
+ * Walk all job trees in parallel, running process_file() on every entry.
+ * Errors on the way count against their job; only a walker that cannot be
+ * set up returns -1 with errno set. Without threads it walks on the caller's.
+ */
+static int walk_jobs(convert_job_t *jobs, int num_jobs) {
+    walker_t w;
+    int started = 0;
+    
+    memset(&w, 0, sizeof(w));
+    w.num_workers = walker_jobs();
+    w.jobs = jobs;
+    w.num_jobs = num_jobs;
+    for (int i = 0; i < num_jobs; i++) {
+        job_select_kernel(&jobs[i]);
+    }
+    pthread_mutex_init(&w.sched_lock, NULL);
+    pthread_mutex_init(&w.idle_lock, NULL);
+    pthread_cond_init(&w.idle_cond, NULL);
+    pthread_mutex_init(&w.spill_lock, NULL);
+    w.spill_fd = -1;
+    w.max_open = g_max_open;
+    if (w.max_open <= 0) {
+        struct rlimit rl;
+        
+        w.max_open = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY ?
+                     (long)(rl.rlim_cur / 2) : 1024;
+    }
+    
+    w.workers = calloc(w.num_workers, sizeof(walk_worker_t));
+    if (!w.workers) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (int i = 0; i < w.num_workers; i++) {
+        w.workers[i].walker = &w;
+        w.workers[i].id = i;
+        pthread_mutex_init(&w.workers[i].deque.lock, NULL);
+    }
+    
+    if (g_throttle) {
+        throttle_reset(&throttle, stats_now(), 1);
+    }
+    pthread_mutex_lock(&w.sched_lock);
+    schedule_jobs(&w.workers[0]);
+    pthread_mutex_unlock(&w.sched_lock);
+    
+    if (w.pending > 0) {
+        reporter_start(&w);
+        prefetch_start();
+        for (; started < w.num_workers; started++) {
+            if (pthread_create(&w.workers[started].thread, NULL,
+                               walker_thread, &w.workers[started]) != 0) {
+                break;
+            }
+        }
+        if (started == 0) {
+            /* No threads available, walk on this thread instead */
+            walker_thread(&w.workers[0]);
+        }
+        for (int i = 0; i < started; i++) {
+            pthread_join(w.workers[i].thread, NULL);
+        }
+        
+        /* The rest of each journal's batch, while the jobs' filesystems are open */
+        for (int i = 0; i < num_jobs; i++) {
+            if (jobs[i].journal) {
+                journal_flush(jobs[i].journal);
+            }
+        }
+        prefetch_stop();
+        reporter_stop();
+    }
+    
+    for (int i = 0; i < w.num_workers; i++) {
+        slab_release(&w.workers[i].slab);
+        free(w.workers[i].deque.items);
+        if (w.workers[i].ring) {
+            uring_close(w.workers[i].ring);
+            free(w.workers[i].ring);
+        }
+        free(w.workers[i].dentbuf);
+        free(w.workers[i].pathbuf);
+        pthread_mutex_destroy(&w.workers[i].deque.lock);
+    }
+    free(w.workers);
+    if (w.spilled > 0) {
+        printf("%"PRIu64" queued directories went through a spill file\n", w.spilled);
+    }
+    if (w.spill_fd >= 0) {
+        close(w.spill_fd);
+    }
+    pthread_mutex_destroy(&w.spill_lock);
+    pthread_mutex_destroy(&w.sched_lock);
+    pthread_mutex_destroy(&w.idle_lock);
+    pthread_cond_destroy(&w.idle_cond);
+    
+    return 0;
+}
+
+/*
+ * Scheduling key for the storage behind a mounted filesystem: the pool for
+ * ZFS datasets, the source device for other block filesystems, and the
+ * device number for anything else.
+ */
+static void device_key(dev_t dev, char *key, size_t len) {
+    char line[MAX_LINE];
+    FILE *fp;
+    
+    snprintf(key, len, "dev:%u:%u", major(dev), minor(dev));
+    fp = fopen("/proc/self/mountinfo", "r");
+    if (!fp) {
+        return;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        unsigned int maj, min;
+        char fstype[64], source[256];
+        char *sep;
+        
+        /* "<id> <parent> <major>:<minor> <root> <mountpoint> <opts> ... - <type> <source> ..." */
+        if (sscanf(line, "%*d %*d %u:%u", &maj, &min) != 2 ||
+            maj != major(dev) || min != minor(dev) ||
+            !(sep = strstr(line, " - ")) ||
+            sscanf(sep + 3, "%63s %255s", fstype, source) != 2) {
+            continue;
+        }
+        if (strcmp(fstype, "zfs") == 0) {
+            source[strcspn(source, "/")] = '\0';
+            snprintf(key, len, "zfs:%s", source);
+        } else if (strncmp(source, "/dev/", 5) == 0) {
+            snprintf(key, len, "%s", source);
+        }
+        break;
+    }
+    fclose(fp);
+}
+
+/* Set up a job for one filesystem path */
+static int job_init(convert_job_t *job, const char *path, int offset,
+                    const id_mapping_t *map, int container, journal_t *journal) {
+    struct stat st;
+    
+    /* Check if path exists */
+    if (stat(path, &st) == -1) {
+        fprintf(stderr, "Error: Path %s does not exist: %s\n", path, strerror(errno));
+        return -1;
+    }
+    
+    if (!S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Error: Path %s is not a directory\n", path);
+        return -1;
+    }
+    
+    memset(job, 0, sizeof(*job));
+    job->path = path;
+    job->offset = offset;
+    job->map = map;
+    job->container = container;
+    job->journal = journal;
+    job->path_hash = journal_path_hash(path);
+    job->idempotent = g_idempotent || (journal && journal->resume);
+    job->dev = st.st_dev;
+    device_key(st.st_dev, job->device, sizeof(job->device));
+    job->mount_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    return 0;
+}
+
+/* Convert filesystem paths, independent devices in parallel */
+static int convert_jobs(convert_job_t *jobs, int num_jobs) {
+    int result = 0;
+    
+    g_proc_fd = access("/proc/self/fd", X_OK) == 0;
+    if (g_io_uring == 1 && !uring_supported()) {
+        printf("io_uring with IORING_OP_STATX not available, using statx()\n");
+        g_io_uring = 0;
+    }
+    
+    /* Walk the directory trees */
+    if (num_jobs > 0 && walk_jobs(jobs, num_jobs) == -1) {
+        fprintf(stderr, "\nError walking directory tree: %s\n", strerror(errno));
+        result = -1;
+    }
+    if (g_throttle && throttle.min_rate > 0) {
+        printf("Throttled to as low as %.0f entries/s, walker threads slept %.1f s\n",
+               throttle.min_rate, throttle.wait_ns / 1e9);
+    }
+    for (int i = 0; i < num_jobs; i++) {
+        if (jobs[i].mount_fd >= 0) {
+            close(jobs[i].mount_fd);
+            jobs[i].mount_fd = -1;
+        }
+        if (jobs[i].state != JOB_DONE) {
+            jobs[i].result = -1;
+        }
+        if (jobs[i].result != 0) {
+            result = -1;
+        }
+    }
+    
+    return result;
+}
+
+/*
+ * Dry-run census (--dry-run)
+ *
+ * The walker runs as usual but process_file() only counts entries, so the
+ * census costs what the read side of a conversion costs. The projection
+ * adds one fchown per entry and one xattr rewrite per ACL at the rate
+ * measured on an unlinked O_TMPFILE in the path, spread over the walker
+ * threads, to the measured walk time.
+ */
+static int census_init(convert_job_t *job) {
+    census_t *c = calloc(1, sizeof(census_t));
+    
+    if (!c || !(c->uid_hist = calloc(CENSUS_IDS + 1, sizeof(uint64_t))) ||
+        !(c->gid_hist = calloc(CENSUS_IDS + 1, sizeof(uint64_t)))) {
+        if (c) {
+            free(c->uid_hist);
+            free(c);
+        }
+        fprintf(stderr, "Failed to allocate census for %s\n", job->path);
+        return -1;
+    }
+    job->census = c;
+    return 0;
+}
+
+static void census_free(convert_job_t *job) {
+    if (job->census) {
+        free(job->census->uid_hist);
+        free(job->census->gid_hist);
+        free(job->census);
+        job->census = NULL;
+    }
+}
+
+/* Time fchown on an anonymous file of the filesystem, nothing visible changes */
+static double census_chown_cost(const char *path) {
+    struct timespec start, end;
+    int fd = open(path, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    int done = 0;
+    
+    if (fd == -1) {
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (; done < CENSUS_CHOWN_SAMPLES; done++) {
+        uid_t id = done & 1 ? UID_GID_OFFSET : 0;
+        if (fchown(fd, id, id) == -1) {
+            break;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    close(fd);
+    if (done < CENSUS_CHOWN_SAMPLES) {
+        return 0;
+    }
+    return ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9) / done;
+}
+
+/* Projected seconds for converting the path with the given number of threads */
+static double census_projection(const convert_job_t *job, int threads) {
+    const census_t *c = job->census;
+    double writes = (double)(c->dirs + c->files) + c->acl_access + c->acl_default;
+    
+    return job->elapsed + writes * c->chown_cost / threads;
+}
+
+static void census_print_ids(const char *label, const uint64_t *hist, const uint64_t *classes) {
+    uint32_t top[CENSUS_TOP_IDS];
+    int num_top = 0;
+    uint64_t num_ids = 0;
+    
+    /* Keep the most common ids in count order, insertion is fine for a handful */
+    for (uint32_t id = 0; id <= CENSUS_IDS; id++) {
+        int pos;
+        
+        if (hist[id] == 0) {
+            continue;
+        }
+        num_ids++;
+        for (pos = num_top; pos > 0 && hist[top[pos - 1]] < hist[id]; pos--) {
+            if (pos < CENSUS_TOP_IDS) {
+                top[pos] = top[pos - 1];
+            }
+        }
+        if (pos < CENSUS_TOP_IDS) {
+            top[pos] = id;
+            num_top += num_top < CENSUS_TOP_IDS;
+        }
+    }
+    
+    printf("  %s: %"PRIu64" to convert, %"PRIu64" converted, %"PRIu64" out of range\n",
+           label, classes[ID_SOURCE], classes[ID_TARGET], classes[ID_OUT]);
+    printf("   ");
+    for (int i = 0; i < num_top; i++) {
+        if (top[i] == CENSUS_IDS) {
+            printf("%s >=%d (%"PRIu64")", i ? "," : "", CENSUS_IDS, hist[top[i]]);
+        } else {
+            printf("%s %u (%"PRIu64")", i ? "," : "", top[i], hist[top[i]]);
+        }
+    }
+    if (num_ids > (uint64_t)num_top) {
+        printf(" (%"PRIu64" more ids)", num_ids - num_top);
+    }
+    printf("\n");
+}
+
+static void census_print(const convert_job_t *job, int threads) {
+    const census_t *c = job->census;
+    uint64_t entries = c->dirs + c->files;
+    
+    printf("\nCensus of %s:\n", job->path);
+    printf("  Directories:  %"PRIu64"\n", c->dirs);
+    printf("  Files:        %"PRIu64" (%"PRIu64" with several links, %"PRIu64" further links)\n",
+           c->files, c->hardlinked, c->extra_links);
+    if (job->no_acl) {
+        printf("  ACLs:         not supported\n");
+    } else {
+        printf("  ACLs:         %"PRIu64" access, %"PRIu64" default\n",
+               c->acl_access, c->acl_default);
+    }
+    census_print_ids("UIDs", c->uid_hist, c->uid_class);
+    census_print_ids("GIDs", c->gid_hist, c->gid_class);
+    printf("  Walk:         %.2f s, %.0f entries/s\n", job->elapsed,
+           job->elapsed > 0 ? entries / job->elapsed : 0.0);
+    if (c->chown_cost > 0) {
+        printf("  Projected:    %.1f s (%.1f us per chown, %d threads)\n",
+               census_projection(job, threads), c->chown_cost * 1e6, threads);
+    } else {
+        printf("  Projected:    at least %.1f s (chown cost not measurable here)\n",
+               job->elapsed);
+    }
+    if (job->errors > 0) {
+        printf("  Errors:       %"PRIu64"\n", job->errors);
+    }
+}
+
+/*
+ * Projected wall-clock time of converting all jobs: paths sharing a device
+ * take turns g_per_device at a time, devices run in parallel.
+ */
+static double census_total(const convert_job_t *jobs, int num_jobs, int threads) {
+    double total = 0;
+    
+    for (int i = 0; i < num_jobs; i++) {
+        double device = 0;
+        int first = 1;
+        
+        for (int k = 0; k < num_jobs; k++) {
+            if (strcmp(jobs[k].device, jobs[i].device) == 0) {
+                first &= k >= i;
+                device += census_projection(&jobs[k], threads);
+            }
+        }
+        if (first && device / g_per_device > total) {
+            total = device / g_per_device;
+        }
+    }
+    return total;
+}
+
+/* Print s as a JSON string */
+static void json_string(FILE *fp, const char *s) {
+    fputc('"', fp);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        
+        if (c == '"' || c == '\\') {
+            fprintf(fp, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(fp, "\\u%04x", c);
+        } else {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+/*
+ * One-line JSON report for --stats=json: totals, the jobs, every syscall
+ * type with calls, time and latency histogram, and per-thread call counts.
+ */
+static void stats_print_json(const convert_job_t *jobs, int num_jobs, double seconds) {
+    thread_stats_t total;
+    struct rusage ru;
+    uint64_t files = 0, errors = 0;
+    
+    memset(&total, 0, sizeof(total));
+    for (int t = 0; t <= MAX_JOBS; t++) {
+        for (int op = 0; op < STATS_OPS; op++) {
+            total.calls[op] += g_thread_stats[t].calls[op];
+            total.ns[op] += g_thread_stats[t].ns[op];
+            for (int b = 0; b < STATS_HIST_BUCKETS; b++) {
+                total.hist[op][b] += g_thread_stats[t].hist[op][b];
+            }
+        }
+    }
+    for (int i = 0; i < num_jobs; i++) {
+        files += jobs[i].files_processed;
+        errors += jobs[i].errors;
+    }
+    
+    fflush(stdout);
+    printf("{\"version\":1,\"files\":%"PRIu64",\"errors\":%"PRIu64",\"seconds\":%.6f",
+           files, errors, seconds);
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+        printf(",\"maxrss_kb\":%ld", ru.ru_maxrss);
+    }
+    if (g_throttle) {
+        printf(",\"throttle\":{\"min_rate\":%.0f,\"wait_ns\":%"PRIu64"}",
+               throttle.min_rate, throttle.wait_ns);
+    }
+    
+    printf(",\"jobs\":[");
+    for (int i = 0; i < num_jobs; i++) {
+        printf("%s{\"path\":", i ? "," : "");
+        json_string(stdout, jobs[i].path);
+        printf(",\"device\":");
+        json_string(stdout, jobs[i].device);
+        printf(",\"files\":%"PRIu64",\"errors\":%"PRIu64",\"skipped\":%"PRIu64
+               ",\"out_of_range\":%"PRIu64",\"seconds\":%.6f}", jobs[i].files_processed,
+               jobs[i].errors, jobs[i].skipped, jobs[i].out_of_range, jobs[i].elapsed);
+    }
+    
+    printf("],\"ops\":{");
+    for (int op = 0; op < STATS_OPS; op++) {
+        int last = STATS_HIST_BUCKETS - 1;
+        
+        while (last > 0 && total.hist[op][last] == 0) {
+            last--;
+        }
+        printf("%s\"%s\":{\"calls\":%"PRIu64",\"ns\":%"PRIu64",\"hist_log2_ns\":[",
+               op ? "," : "", stats_names[op], total.calls[op], total.ns[op]);
+        for (int b = 0; b <= last; b++) {
+            printf("%s%"PRIu64, b ? "," : "", total.hist[op][b]);
+        }
+        printf("]}");
+    }
+    
+    printf("},\"threads\":[");
+    for (int t = 0, first = 1; t <= MAX_JOBS; t++) {
+        uint64_t any = 0;
+        
+        for (int op = 0; op < STATS_OPS; op++) {
+            any |= g_thread_stats[t].calls[op];
+        }
+        if (!any) {
+            continue;
+        }
+        printf("%s{\"thread\":%d", first ? "" : ",", t);
+        for (int op = 0; op < STATS_OPS; op++) {
+            printf(",\"%s\":%"PRIu64, stats_names[op], g_thread_stats[t].calls[op]);
+        }
+        printf("}");
+        first = 0;
+    }
+    printf("]}\n");
+    fflush(stdout);
+}
+
+/*
+ * ZFS clone conversion (--zfs-clone)
+ *
+ * When every filesystem of a container is a ZFS dataset, the bulk of the
+ * work runs while the container may still be up: each dataset is
+ * snapshotted and cloned, and the walker converts the clones. Then the
+ * container is stopped, a second snapshot is taken, and only what
+ * `zfs diff` lists between the two snapshots is copied into the clone with
+ * rsync and converted. Finally each clone takes over the dataset's name
+ * and mountpoint and is promoted. The original is kept under a new name
+ * until it is destroyed by hand. Downtime scales with the changes made
+ * during the bulk pass, not with the number of files.
+ */
+#define ZFS_SNAP_BASE "privconvert-base"
+#define ZFS_SNAP_FINAL "privconvert-final"
+#define ZFS_CLONE_SUFFIX "-privconvert"
+#define ZFS_OLD_SUFFIX "-privconvert-old"
+
+typedef struct {
+    const char *path;                   /* Configured path, the dataset's mountpoint */
+    char dataset[MAX_PATH_LEN];
+    char clone[MAX_PATH_LEN + 16];
+    char clone_path[MAX_PATH_LEN + 16];
+} zfs_target_t;
+
+/* Run a shell command built from fmt, arguments must be shell-safe */
+static int run_cmd(const char *fmt, ...) {
+    char cmd[3 * MAX_PATH_LEN + 128];
+    va_list ap;
+    int n;
+    
+    va_start(ap, fmt);
+    n = vsnprintf(cmd, sizeof(cmd), fmt, ap);
+    va_end(ap);
+    if (n < 0 || (size_t)n >= sizeof(cmd)) {
+        fprintf(stderr, "Error: command too long\n");
+        return -1;
+    }
+    printf("  %s\n", cmd);
+    fflush(stdout);
+    if (system(cmd) != 0) {
+        fprintf(stderr, "Error: command failed: %s\n", cmd);
+        return -1;
+    }
+    return 0;
+}
+
+/* Arguments are passed in single quotes, so only these cannot be used */
+static int shell_safe(const char *s) {
+    return !strpbrk(s, "'\n");
+}
+
+/* Decode octal escapes in place: mountinfo writes "\ooo", zfs diff "\0ooo" */
+static void unescape_octal(char *s, int digits) {
+    char *out = s;
+    
+    while (*s) {
+        if (s[0] == '\\' && s[1] >= '0' && s[1] <= '7') {
+            int value = 0;
+            
+            s++;
+            for (int i = 0; i < digits && *s >= '0' && *s <= '7'; i++) {
+                value = value * 8 + (*s++ - '0');
+            }
+            *out++ = (char)value;
+        } else {
+            *out++ = *s++;
+        }
+    }
+    *out = '\0';
+}
+
+/* Find the ZFS dataset mounted exactly at path */
+static int zfs_dataset(const char *path, char *dataset, size_t len) {
+    char line[MAX_LINE];
+    FILE *fp;
+    int found = -1;
+    
+    fp = fopen("/proc/self/mountinfo", "r");
+    if (!fp) {
+        return -1;
+    }
+    while (found == -1 && fgets(line, sizeof(line), fp)) {
+        char mountpoint[MAX_PATH_LEN], source[MAX_PATH_LEN], fstype[64];
+        char *sep = strstr(line, " - ");
+        
+        if (!sep || sscanf(line, "%*d %*d %*s %*s %2047s", mountpoint) != 1 ||
+            sscanf(sep + 3, "%63s %2047s", fstype, source) != 2 ||
+            strcmp(fstype, "zfs") != 0) {
+            continue;
+        }
+        unescape_octal(mountpoint, 3);
+        unescape_octal(source, 3);
+        if (strcmp(mountpoint, path) == 0) {
+            snprintf(dataset, len, "%s", source);
+            found = 0;
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+/* Convert a single entry given by path, directories without their contents */
+static void convert_entry(convert_job_t *job, const char *path) {
+    char dir[MAX_PATH_LEN];
+    const char *name = strrchr(path, '/');
+    struct stat st;
+    int dirfd, fd = -1;
+    
+    if (!name || (size_t)(name - path) >= sizeof(dir)) {
+        return;
+    }
+    memcpy(dir, path, name - path);
+    dir[name - path] = '\0';
+    name++;
+    
+    dirfd = open(dir[0] ? dir : "/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd == -1 || stat_at(dirfd, name, &st) == -1) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "Error stating %s: %s\n", path, strerror(errno));
+            job_error(job);
+        }
+        if (dirfd != -1) {
+            close(dirfd);
+        }
+        return;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd == -1) {
+            fprintf(stderr, "Error opening directory %s: %s\n", path, strerror(errno));
+            job_error(job);
+            close(dirfd);
+            return;
+        }
+    }
+    
+    file_ref_t ref = { fd, fd == -1 ? dirfd : -1, name, path, NULL };
+    process_file(job, &ref, &st);
+    if (fd != -1) {
+        close(fd);
+    }
+    close(dirfd);
+}
+
+/* Append a NUL terminated name to an rsync --from0 list */
+static int list_add(FILE *list, const char *rel) {
+    return fputs(*rel ? rel : ".", list) == EOF || fputc('\0', list) == EOF ? -1 : 0;
+}
+
+/*
+ * rsync -H only links names that are all in its list, so the copy of a
+ * name whose inode has other names outside the list is a separate inode.
+ * The link counts of the copies show it.
+ */
+static const char *links_snapshot;  /* Final snapshot path for nftw() */
+static size_t links_prefix;         /* Length of the clone path it replaces */
+static int links_split;
+
+static int links_check(const char *copy, const char *snap) {
+    struct stat a, b;
+    
+    if (lstat(snap, &a) == -1 || !S_ISREG(a.st_mode) || lstat(copy, &b) == -1 ||
+        a.st_nlink == b.st_nlink) {
+        return 0;
+    }
+    fprintf(stderr, "Error: %s has %lu links but its copy %s has %lu, a hard link was split\n",
+            snap, (unsigned long)a.st_nlink, copy, (unsigned long)b.st_nlink);
+    links_split = 1;
+    return -1;
+}
+
+static int links_check_entry(const char *path, const struct stat *sb, int type, struct FTW *ftw) {
+    char snap[3 * MAX_PATH_LEN];
+    
+    (void)ftw;
+    if (type == FTW_F && S_ISREG(sb->st_mode)) {
+        snprintf(snap, sizeof(snap), "%s%s", links_snapshot, path + links_prefix);
+        links_check(path, snap);
+    }
+    return 0;
+}
+
+static int compare_length_desc(const void *a, const void *b) {
+    size_t x = strlen(*(char *const *)a), y = strlen(*(char *const *)b);
+    return (x < y) - (x > y);
+}
+
+/*
+ * Bring a converted clone up to date with the final snapshot: remove what
+ * was removed, copy what was added or changed, and convert the copies.
+ * Changed files are rewritten in place, so names of theirs that did not
+ * change keep sharing the inode; a copy whose link count still differs
+ * fails the pass.
+ */
+static int zfs_final_pass(zfs_target_t *zt, int offset, const id_mapping_t *map) {
+    char cmd[3 * MAX_PATH_LEN];
+    char line[3 * MAX_PATH_LEN];
+    char files_list[] = "/tmp/privconvert-files.XXXXXX";
+    char dirs_list[] = "/tmp/privconvert-dirs.XXXXXX";
+    char **removed = NULL, **copied = NULL, **renamed = NULL;
+    size_t num_removed = 0, num_copied = 0, num_renamed = 0;
+    size_t path_len = strlen(zt->path);
+    convert_job_t job;
+    FILE *diff, *files = NULL, *dirs = NULL;
+    int files_fd, dirs_fd;
+    int result = -1;
+    
+    memset(&job, 0, sizeof(job));
+    job.path = zt->clone_path;
+    job.offset = offset;
+    job.map = map;
+    job.idempotent = 1;     /* Copies arrive unconverted, the rest is left alone */
+    job.mount_fd = -1;
+    job_select_kernel(&job);
+    
+    files_fd = mkstemp(files_list);
+    dirs_fd = mkstemp(dirs_list);
+    if (files_fd == -1 || dirs_fd == -1 || !(files = fdopen(files_fd, "w")) ||
+        !(dirs = fdopen(dirs_fd, "w"))) {
+        fprintf(stderr, "Error creating file lists: %s\n", strerror(errno));
+        goto out;
+    }
+    
+    snprintf(cmd, sizeof(cmd), "zfs diff -FH '%s@" ZFS_SNAP_BASE "' '%s@" ZFS_SNAP_FINAL "'",
+             zt->dataset, zt->dataset);
+    printf("  %s\n", cmd);
+    diff = popen(cmd, "r");
+    if (!diff) {
+        fprintf(stderr, "Error running zfs diff: %s\n", strerror(errno));
+        goto out;
+    }
+    
+    /* "<change>\t<type>\t<path>[\t<new path>]" with paths below the mountpoint */
+    while (fgets(line, sizeof(line), diff)) {
+        char *fields[4] = { NULL };
+        char *p = line;
+        int n = 0;
+        
+        line[strcspn(line, "\n")] = '\0';
+        while (n < 4 && (fields[n] = strsep(&p, "\t"))) {
+            unescape_octal(fields[n++], 4);
+        }
+        if (n < 3 || strncmp(fields[2], zt->path, path_len) != 0) {
+            continue;
+        }
+        
+        char *rel = strdup(fields[2] + path_len + (fields[2][path_len] == '/'));
+        char **grown;
+        
+        if (!rel) {
+            pclose(diff);
+            goto nomem;
+        }
+        if (fields[0][0] == '-' || fields[0][0] == 'R') {
+            grown = realloc(removed, (num_removed + 1) * sizeof(char *));
+            if (!grown) {
+                free(rel);
+                pclose(diff);
+                goto nomem;
+            }
+            removed = grown;
+            removed[num_removed++] = rel;
+            if (fields[0][0] == '-') {
+                continue;
+            }
+            if (n < 4 || strncmp(fields[3], zt->path, path_len) != 0 ||
+                !(rel = strdup(fields[3] + path_len + (fields[3][path_len] == '/')))) {
+                continue;
+            }
+        }
+        
+        /* A renamed directory brings its whole subtree along */
+        if (fields[0][0] == 'R' && fields[1][0] == '/') {
+            grown = realloc(renamed, (num_renamed + 1) * sizeof(char *));
+            if (!grown || list_add(dirs, rel) == -1) {
+                free(rel);
+                pclose(diff);
+                goto nomem;
+            }
+            renamed = grown;
+            renamed[num_renamed++] = rel;
+        } else {
+            grown = realloc(copied, (num_copied + 1) * sizeof(char *));
+            if (!grown || list_add(files, rel) == -1) {
+                free(rel);
+                pclose(diff);
+                goto nomem;
+            }
+            copied = grown;
+            copied[num_copied++] = rel;
+        }
+    }
+    if (pclose(diff) != 0) {
+        fprintf(stderr, "Error: zfs diff failed for %s\n", zt->dataset);
+        goto out;
+    }
+    printf("  %zu removed, %zu added or changed, %zu renamed directories\n",
+           num_removed, num_copied, num_renamed);
+    
+    /* Deepest first, so directories are empty by the time they are removed */
+    qsort(removed, num_removed, sizeof(char *), compare_length_desc);
+    for (size_t i = 0; i < num_removed; i++) {
+        char path[2 * MAX_PATH_LEN + 32];
+        
+        snprintf(path, sizeof(path), "%s/%s", zt->clone_path, removed[i]);
+        if (unlink(path) == 0 || errno == ENOENT || (errno == EISDIR && rmdir(path) == 0)) {
+            continue;
+        }
+        /* A renamed directory, its entries are not listed */
+        if (errno == ENOTEMPTY && shell_safe(path)) {
+            if (run_cmd("rm -rf -- '%s'", path) == -1) {
+                goto out;
+            }
+            continue;
+        }
+        fprintf(stderr, "Error removing %s: %s\n", path, strerror(errno));
+        goto out;
+    }
+    
+    if (fflush(files) == EOF || fflush(dirs) == EOF) {
+        fprintf(stderr, "Error writing file lists: %s\n", strerror(errno));
+        goto out;
+    }
+    if (num_copied > 0 &&
+        run_cmd("rsync -aHAX --inplace --numeric-ids --from0 --files-from='%s' "
+                "'%s/.zfs/snapshot/" ZFS_SNAP_FINAL "/' '%s/'",
+                files_list, zt->path, zt->clone_path) == -1) {
+        goto out;
+    }
+    if (num_renamed > 0 &&
+        run_cmd("rsync -raHAX --numeric-ids --from0 --files-from='%s' "
+                "'%s/.zfs/snapshot/" ZFS_SNAP_FINAL "/' '%s/'",
+                dirs_list, zt->path, zt->clone_path) == -1) {
+        goto out;
+    }
+    
+    /* Hard links the copies may have split */
+    links_split = 0;
+    for (size_t i = 0; i < num_copied; i++) {
+        char path[2 * MAX_PATH_LEN + 32];
+        char snap[3 * MAX_PATH_LEN];
+        
+        snprintf(path, sizeof(path), "%s/%s", zt->clone_path, copied[i]);
+        snprintf(snap, sizeof(snap), "%s/.zfs/snapshot/" ZFS_SNAP_FINAL "/%s", zt->path,
+                 copied[i]);
+        links_check(path, snap);
+    }
+    for (size_t i = 0; i < num_renamed; i++) {
+        char path[2 * MAX_PATH_LEN + 32];
+        char snap[3 * MAX_PATH_LEN];
+        
+        snprintf(path, sizeof(path), "%s/%s", zt->clone_path, renamed[i]);
+        snprintf(snap, sizeof(snap), "%s/.zfs/snapshot/" ZFS_SNAP_FINAL "/%s", zt->path,
+                 renamed[i]);
+        links_snapshot = snap;
+        links_prefix = strlen(path);
+        nftw(path, links_check_entry, 16, FTW_PHYS | FTW_MOUNT);
+    }
+    if (links_split) {
+        fprintf(stderr, "Error: the final pass cannot keep these hard links, "
+                "convert without --zfs-clone\n");
+        goto out;
+    }
+    
+    /* Inode numbers of removed files may have been reused by the copies */
+    free_inode_table();
+    for (size_t i = 0; i < num_copied; i++) {
+        char path[2 * MAX_PATH_LEN + 32];
+        
+        snprintf(path, sizeof(path), "%s%s%s", zt->clone_path, *copied[i] ? "/" : "",
+                 copied[i]);
+        convert_entry(&job, path);
+    }
+    if (num_renamed > 0) {
+        convert_job_t *jobs = calloc(num_renamed, sizeof(convert_job_t));
+        char (*paths)[MAX_PATH_LEN] = calloc(num_renamed, MAX_PATH_LEN);
+        int num_jobs = 0;
+        
+        if (!jobs || !paths) {
+            free(jobs);
+            free(paths);
+            goto nomem;
+        }
+        for (size_t i = 0; i < num_renamed; i++) {
+            int n = snprintf(paths[i], MAX_PATH_LEN, "%s/%s", zt->clone_path, renamed[i]);
+            
+            if (n >= MAX_PATH_LEN) {
+                fprintf(stderr, "Error: path too long: %s/%s\n", zt->clone_path, renamed[i]);
+                job_error(&job);
+                continue;
+            }
+            if (job_init(&jobs[num_jobs], paths[i], offset, map, 0, NULL) == 0) {
+                jobs[num_jobs++].idempotent = 1;
+            }
+        }
+        if (convert_jobs(jobs, num_jobs) == -1) {
+            job_error(&job);
+        }
+        free(jobs);
+        free(paths);
+    }
+    
+    result = job.errors > 0 ? -1 : 0;
+    goto out;
+    
+nomem:
+    fprintf(stderr, "Failed to allocate memory for the change list\n");
+out:
+    for (size_t i = 0; i < num_removed; i++) {
+        free(removed[i]);
+    }
+    for (size_t i = 0; i < num_copied; i++) {
+        free(copied[i]);
+    }
+    for (size_t i = 0; i < num_renamed; i++) {
+        free(renamed[i]);
+    }
+    free(removed);
+    free(copied);
+    free(renamed);
+    if (files) {
+        fclose(files);
+    } else if (files_fd != -1) {
+        close(files_fd);
+    }
+    if (dirs) {
+        fclose(dirs);
+    } else if (dirs_fd != -1) {
+        close(dirs_fd);
+    }
+    if (files_fd != -1) {
+        unlink(files_list);
+    }
+    if (dirs_fd != -1) {
+        unlink(dirs_list);
+    }
+    return result;
+}
+
+/* Give a converted clone the dataset's name and mountpoint */
+static int zfs_swap(zfs_target_t *zt) {
+    char cmd[MAX_PATH_LEN + 64];
+    char source[64] = "";
+    FILE *fp;
+    
+    snprintf(cmd, sizeof(cmd), "zfs get -H -o source mountpoint '%s'", zt->dataset);
+    fp = popen(cmd, "r");
+    if (!fp || !fgets(source, sizeof(source), fp)) {
+        fprintf(stderr, "Error reading mountpoint of %s\n", zt->dataset);
+        if (fp) {
+            pclose(fp);
+        }
+        return -1;
+    }
+    pclose(fp);
+    
+    if (run_cmd("zfs set mountpoint='%s" ZFS_OLD_SUFFIX "' '%s'", zt->path, zt->dataset) == -1 ||
+        run_cmd("zfs rename '%s' '%s" ZFS_OLD_SUFFIX "'", zt->dataset, zt->dataset) == -1 ||
+        run_cmd("zfs rename '%s' '%s'", zt->clone, zt->dataset) == -1) {
+        return -1;
+    }
+    if (strncmp(source, "local", 5) == 0) {
+        if (run_cmd("zfs set mountpoint='%s' '%s'", zt->path, zt->dataset) == -1) {
+            return -1;
+        }
+    } else if (run_cmd("zfs inherit mountpoint '%s'", zt->dataset) == -1) {
+        return -1;
+    }
+    return run_cmd("zfs promote '%s'", zt->dataset);
+}
+
+/* Convert all filesystems of a container through ZFS clones */
+static int zfs_clone_convert(int container_id, char **paths, int num_paths,
+                             int offset, const id_mapping_t *map, int running) {
+    zfs_target_t *zts;
+    convert_job_t *jobs;
+    int snapshots = 0;      /* Datasets with a base snapshot, maybe a clone */
+    int result = -1;
+    
+    zts = calloc(num_paths, sizeof(zfs_target_t));
+    jobs = calloc(num_paths, sizeof(convert_job_t));
+    if (!zts || !jobs) {
+        fprintf(stderr, "Failed to allocate memory for ZFS conversion\n");
+        goto out;
+    }
+    if (system("command -v rsync >/dev/null 2>&1") != 0) {
+        fprintf(stderr, "Error: --zfs-clone needs rsync for the final pass\n");
+        goto out;
+    }
+    for (int i = 0; i < num_paths; i++) {
+        zfs_target_t *zt = &zts[i];
+        
+        zt->path = paths[i];
+        if (zfs_dataset(paths[i], zt->dataset, sizeof(zt->dataset)) == -1) {
+            fprintf(stderr, "Error: %s is not the mountpoint of a ZFS dataset\n", paths[i]);
+            goto out;
+        }
+        snprintf(zt->clone, sizeof(zt->clone), "%s" ZFS_CLONE_SUFFIX, zt->dataset);
+        snprintf(zt->clone_path, sizeof(zt->clone_path), "%s" ZFS_CLONE_SUFFIX, paths[i]);
+        if (!shell_safe(zt->dataset) || !shell_safe(zt->path)) {
+            fprintf(stderr, "Error: cannot pass %s to zfs safely\n", zt->dataset);
+            goto out;
+        }
+    }
+    
+    printf("\nCloning datasets...\n");
+    for (int i = 0; i < num_paths; i++) {
+        zfs_target_t *zt = &zts[i];
+        
+        if (run_cmd("zfs snapshot '%s@" ZFS_SNAP_BASE "'", zt->dataset) == -1) {
+            goto out;
+        }
+        snapshots++;
+        if (run_cmd("zfs clone -o mountpoint='%s' '%s@" ZFS_SNAP_BASE "' '%s'",
+                    zt->clone_path, zt->dataset, zt->clone) == -1) {
+            goto out;
+        }
+    }
+    
+    for (int i = 0; i < num_paths; i++) {
+        if (job_init(&jobs[i], zts[i].clone_path, offset, map, 0, NULL) == -1) {
+            goto out;
+        }
+    }
+    if (convert_jobs(jobs, num_paths) == -1) {
+        fprintf(stderr, "\nConversion of the clones failed, the container was not touched.\n");
+        goto out;
+    }
+    
+    if (running) {
+        printf("\nStopping container %d for the final pass...\n", container_id);
+        if (run_cmd("pct stop %d", container_id) == -1) {
+            goto out;
+        }
+    }
+    
+    printf("\nCopying changes made during the conversion...\n");
+    for (int i = 0; i < num_paths; i++) {
+        if (run_cmd("zfs snapshot '%s@" ZFS_SNAP_FINAL "'", zts[i].dataset) == -1 ||
+            zfs_final_pass(&zts[i], offset, map) == -1) {
+            goto out;
+        }
+    }
+    
+    printf("\nSwapping in converted datasets...\n");
+    for (int i = 0; i < num_paths; i++) {
+        if (zfs_swap(&zts[i]) == -1) {
+            fprintf(stderr, "\nSwapping %s failed part way, check 'zfs list -r %s' by hand.\n",
+                    zts[i].dataset, zts[i].dataset);
+            snapshots = 0;
+            goto out;
+        }
+    }
+    
+    printf("\nThe unconverted data is kept, remove it once the container works:\n");
+    for (int i = 0; i < num_paths; i++) {
+        printf("  zfs destroy -r '%s" ZFS_OLD_SUFFIX "' && zfs destroy '%s@" ZFS_SNAP_BASE "'\n",
+               zts[i].dataset, zts[i].dataset);
+    }
+    result = 0;
+    
+out:
+    if (result == -1 && snapshots > 0) {
+        printf("\nClones and snapshots made so far are left in place, remove them with:\n");
+        for (int i = 0; i < snapshots; i++) {
+            printf("  zfs destroy -r '%s'; zfs destroy -r '%s@" ZFS_SNAP_BASE "'\n",
+                   zts[i].clone, zts[i].dataset);
+        }
+    }
+    free(zts);
+    free(jobs);
+    return result;
+}
+
+/*
+ * A container config, read once into one buffer and kept as a list of
+ * line views into it; each line is NUL-terminated in place. The rewrite
+ * in update_config() works from the same lines, so the file is only read
+ * again if it changed on disk in between.
+ */
+#define CONFIG_LINE_OTHER 0
+#define CONFIG_LINE_UNPRIVILEGED 1
+#define CONFIG_LINE_ROOTFS_OPTIONS 2
+#define CONFIG_LINE_IDMAP 3
+#define CONFIG_LINE_MOUNT 4     /* rootfs: and mpN: */
+
+/*
+ * lxc.rootfs.options in the main section of a config: ROOTFS_OPTIONS_IDMAP
+ * when it holds exactly the idmapped mount option this tool writes,
+ * ROOTFS_OPTIONS_OTHER when it holds anything else.
+ */
+#define ROOTFS_OPTIONS_NONE 0
+#define ROOTFS_OPTIONS_IDMAP 1
+#define ROOTFS_OPTIONS_OTHER 2
+
+typedef struct {
+    const char *line;
+    size_t len;
+    int kind;                   /* CONFIG_LINE_* */
+    const char *value;          /* After the key's colon and blanks */
+    const char *spec;           /* Mounts: storage spec, up to the first comma */
+    size_t spec_len;
+    const char *options;        /* Mounts: after that comma, NULL if none */
+} config_line_t;
+
+typedef struct {
+    char *buf;
+    size_t size;
+    config_line_t *lines;
+    int num_lines;
+    int main_lines;             /* Lines before the first snapshot section */
+    struct stat st;             /* Of the file read, to notice edits */
+    char **paths;               /* Distinct filesystems, malloc'd */
+    int num_paths;
+    int current_unprivileged;
+    int rootfs_index;           /* Path of the rootfs, -1 if none */
+    int rootfs_options;         /* ROOTFS_OPTIONS_* */
+    lxc_idmap_t idmap;          /* lxc.idmap lines */
+} lxc_config_t;
+
+static void config_free(lxc_config_t *cfg) {
+    for (int i = 0; i < cfg->num_paths; i++) {
+        free(cfg->paths[i]);
+    }
+    free(cfg->paths);
+    free(cfg->lines);
+    free(cfg->buf);
+    memset(cfg, 0, sizeof(*cfg));
+}
+
+/* Host path of a storage spec: a directory, or pool:subvol for /pool/subvol */
+static char *storage_path(const char *spec, size_t len) {
+    const char *colon = memchr(spec, ':', len);
+    char *path = NULL;
+    
+    if (len > 0 && spec[0] == '/') {
+        path = strndup(spec, len);
+    } else if (colon && colon > spec) {
+        const char *subvol = colon + 1;
+        size_t subvol_len = 0;
+        
+        while (subvol + subvol_len < spec + len && !isspace((unsigned char)subvol[subvol_len])) {
+            subvol_len++;
+        }
+        if (subvol_len > 0 &&
+            asprintf(&path, "/%.*s/%.*s", (int)(colon - spec), spec,
+                     (int)subvol_len, subvol) == -1) {
+            path = NULL;
+        }
+    }
+    if (!path) {
+        fprintf(stderr, "Error: Could not parse storage specification: %.*s\n", (int)len, spec);
+    }
+    return path;
+}
+
+/* Slot of path in a power of two sized table of path indexes, -1 = free */
+static int *config_path_slot(int *table, size_t mask, char **paths, const char *path) {
+    size_t i = journal_path_hash(path) & mask;
+    
+    while (table[i] >= 0 && strcmp(paths[table[i]], path) != 0) {
+        i = (i + 1) & mask;
+    }
+    return &table[i];
+}
+
+/* Collect the distinct filesystems of the mount lines in the main section */
+static int config_paths(lxc_config_t *cfg) {
+    int num_mounts = 0;
+    size_t size = 16;
+    int *table;
+    
+    for (int i = 0; i < cfg->main_lines; i++) {
+        num_mounts += cfg->lines[i].kind == CONFIG_LINE_MOUNT;
+    }
+    while (size < 2 * (size_t)num_mounts) {
+        size *= 2;
+    }
+    table = malloc(size * sizeof(int));
+    cfg->paths = malloc((num_mounts ? num_mounts : 1) * sizeof(char *));
+    if (!table || !cfg->paths) {
+        fprintf(stderr, "Failed to allocate memory for paths\n");
+        free(table);
+        return -1;
+    }
+    memset(table, 0xff, size * sizeof(int));
+    
+    for (int i = 0; i < cfg->main_lines; i++) {
+        const config_line_t *l = &cfg->lines[i];
+        char *path;
+        int *slot;
+        
+        if (l->kind != CONFIG_LINE_MOUNT || !(path = storage_path(l->spec, l->spec_len))) {
+            continue;
+        }
+        slot = config_path_slot(table, size - 1, cfg->paths, path);
+        if (*slot >= 0) {
+            free(path);
+        } else {
+            *slot = cfg->num_paths;
+            cfg->paths[cfg->num_paths++] = path;
+        }
+        if (l->line[0] == 'r') {
+            cfg->rootfs_index = *slot;
+        }
+    }
+    free(table);
+    return 0;
+}
+
+/* Classify one line, lxc.idmap lines go straight into the map */
+static int config_parse_line(lxc_config_t *cfg, config_line_t *l) {
+    const char *colon = strchr(l->line, ':');
+    
+    l->kind = CONFIG_LINE_OTHER;
+    if (!colon) {
+        return 0;
+    }
+    l->value = colon + 1;
+    while (*l->value && isspace((unsigned char)*l->value)) l->value++;
+    
+    if (strncmp(l->line, "unprivileged:", 13) == 0) {
+        l->kind = CONFIG_LINE_UNPRIVILEGED;
+        cfg->current_unprivileged = atoi(l->value);
+    } else if (strncmp(l->line, "lxc.idmap:", 10) == 0) {
+        /* "lxc.idmap: u 0 100000 65536" */
+        lxc_idmap_t *idmap = &cfg->idmap;
+        id_extent_t e;
+        char type;
+        
+        l->kind = CONFIG_LINE_IDMAP;
+        if (sscanf(l->value, "%c %u %u %u", &type, &e.first, &e.target, &e.count) != 4 ||
+            (type != 'u' && type != 'g' && type != 'b')) {
+            fprintf(stderr, "Error: Cannot parse %s\n", l->line);
+            return -1;
+        }
+        if (idmap->num_uid >= MAX_IDMAP_EXTENTS || idmap->num_gid >= MAX_IDMAP_EXTENTS) {
+            fprintf(stderr, "Error: Too many lxc.idmap entries\n");
+            return -1;
+        }
+        if (type != 'g') {
+            idmap->uid[idmap->num_uid++] = e;
+        }
+        if (type != 'u') {
+            idmap->gid[idmap->num_gid++] = e;
+        }
+    } else if (strncmp(l->line, "lxc.rootfs.options:", 19) == 0) {
+        l->kind = CONFIG_LINE_ROOTFS_OPTIONS;
+        cfg->rootfs_options = strcmp(l->value, ROOTFS_IDMAP_OPTION) == 0 ?
+                              ROOTFS_OPTIONS_IDMAP : ROOTFS_OPTIONS_OTHER;
+    } else if (strncmp(l->line, "rootfs:", 7) == 0 || strncmp(l->line, "mp", 2) == 0) {
+        const char *comma = strchr(l->value, ',');
+        
+        l->kind = CONFIG_LINE_MOUNT;
+        l->spec = l->value;
+        l->spec_len = comma ? (size_t)(comma - l->value) : strlen(l->value);
+        l->options = comma ? comma + 1 : NULL;
+        while (!comma && l->spec_len > 0 && isspace((unsigned char)l->spec[l->spec_len - 1])) {
+            l->spec_len--;
+        }
+    }
+    return 0;
+}
+
+/* Read a config in one go and split it into lines, paths and the id map */
+static int config_read(const char *config_path, lxc_config_t *cfg) {
+    size_t size = 0, cap_lines = 0;
+    char *p, *end;
+    int fd;
+    
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->current_unprivileged = -1;
+    cfg->rootfs_index = -1;
+    
+    fd = open(config_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &cfg->st) == -1) {
+        fprintf(stderr, "Error opening config file %s: %s\n", config_path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    /* pmxcfs reports sizes, but read until EOF rather than trust them */
+    for (size_t cap = cfg->st.st_size + 1;; cap *= 2) {
+        char *grown = realloc(cfg->buf, cap + 1);
+        ssize_t n = 0;
+        
+        if (!grown) {
+            fprintf(stderr, "Failed to allocate memory for %s\n", config_path);
+            close(fd);
+            config_free(cfg);
+            return -1;
+        }
+        cfg->buf = grown;
+        while (size < cap && (n = read(fd, cfg->buf + size, cap - size)) > 0) {
+            size += n;
+        }
+        if (n == -1) {
+            fprintf(stderr, "Error reading config file %s: %s\n", config_path, strerror(errno));
+            close(fd);
+            config_free(cfg);
+            return -1;
+        }
+        if (size < cap) {
+            break;
+        }
+    }
+    close(fd);
+    cfg->buf[size] = '\0';
+    cfg->size = size;
+    
+    cfg->main_lines = -1;
+    for (p = cfg->buf, end = cfg->buf + size; p < end; p += cfg->lines[cfg->num_lines++].len + 1) {
+        char *newline = memchr(p, '\n', end - p);
+        config_line_t *l;
+        
+        if ((size_t)cfg->num_lines == cap_lines) {
+            config_line_t *grown;
+            
+            cap_lines = cap_lines ? 2 * cap_lines : 64;
+            if (!(grown = realloc(cfg->lines, cap_lines * sizeof(*grown)))) {
+                fprintf(stderr, "Failed to allocate memory for %s\n", config_path);
+                config_free(cfg);
+                return -1;
+            }
+            cfg->lines = grown;
+        }
+        l = &cfg->lines[cfg->num_lines];
+        memset(l, 0, sizeof(*l));
+        l->line = p;
+        l->len = newline ? (size_t)(newline - p) : (size_t)(end - p);
+        p[l->len] = '\0';
+        
+        /* Snapshot sections start with '[', only the main section counts */
+        if (p[0] == '[' && cfg->main_lines == -1) {
+            cfg->main_lines = cfg->num_lines;
+        }
+        if (cfg->main_lines == -1 && config_parse_line(cfg, l) == -1) {
+            config_free(cfg);
+            return -1;
+        }
+    }
+    if (cfg->main_lines == -1) {
+        cfg->main_lines = cfg->num_lines;
+    }
+    
+    if (config_paths(cfg) == -1) {
+        config_free(cfg);
+        return -1;
+    }
+    if (cfg->current_unprivileged == -1) {
+        fprintf(stderr, "Warning: Could not find 'unprivileged' flag in config\n");
+    }
+    return 0;
+}
+
+/*
+ * Update the unprivileged flag in the config file. rootfs_idmap adds or
+ * removes the idmapped rootfs option next to it, or leaves it alone.
+ * cfg is the config as read before the conversion, NULL to read it now.
+ */
+#define ROOTFS_IDMAP_KEEP 0
+#define ROOTFS_IDMAP_ADD 1
+#define ROOTFS_IDMAP_REMOVE 2
+
+static void config_write_flag(FILE *fp, int new_unprivileged, int rootfs_idmap) {
+    fprintf(fp, "unprivileged: %d\n", new_unprivileged);
+    if (rootfs_idmap == ROOTFS_IDMAP_ADD) {
+        fprintf(fp, "lxc.rootfs.options: " ROOTFS_IDMAP_OPTION "\n");
+    }
+}
+
+static int update_config(const char *config_path, const lxc_config_t *cfg,
+                         int new_unprivileged, int rootfs_idmap) {
+    lxc_config_t fresh;
+    struct stat st;
+    FILE *fp_out;
+    char *temp_path;
+    int updated = 0;
+    int result = 0;
+    
+    /* Edited since it was read, e.g. from the web interface */
+    if (cfg && (stat(config_path, &st) == -1 || st.st_ino != cfg->st.st_ino ||
+                st.st_size != cfg->st.st_size ||
+                st.st_mtim.tv_sec != cfg->st.st_mtim.tv_sec ||
+                st.st_mtim.tv_nsec != cfg->st.st_mtim.tv_nsec)) {
+        cfg = NULL;
+    }
+    if (!cfg) {
+        if (config_read(config_path, &fresh) == -1) {
+            return -1;
+        }
+        cfg = &fresh;
+    }
+    
+    /* Create temporary file */
+    if (asprintf(&temp_path, "%s.tmp", config_path) == -1) {
+        fprintf(stderr, "Failed to allocate memory for %s\n", config_path);
+        if (cfg == &fresh) {
+            config_free(&fresh);
+        }
+        return -1;
+    }
+    fp_out = fopen(temp_path, "w");
+    if (!fp_out) {
+        fprintf(stderr, "Error creating temporary file: %s\n", strerror(errno));
+        result = -1;
+        goto out;
+    }
+    
+    /* Copy the lines, updating the unprivileged flag in the main section only */
+    for (int i = 0; i < cfg->num_lines; i++) {
+        const config_line_t *l = &cfg->lines[i];
+        
+        if (i == cfg->main_lines && !updated) {
+            /* Not found, add it before the snapshots */
+            config_write_flag(fp_out, new_unprivileged, rootfs_idmap);
+            updated = 1;
+        }
+        if (i < cfg->main_lines && l->kind == CONFIG_LINE_UNPRIVILEGED) {
+            config_write_flag(fp_out, new_unprivileged, rootfs_idmap);
+            updated = 1;
+        } else if (i < cfg->main_lines && rootfs_idmap != ROOTFS_IDMAP_KEEP &&
+                   l->kind == CONFIG_LINE_ROOTFS_OPTIONS) {
+            /* Replaced next to the unprivileged flag, or dropped */
+        } else {
+            fwrite(l->line, 1, l->len, fp_out);
+            /* Keep a missing newline at the end as it was */
+            if (l->line + l->len < cfg->buf + cfg->size || !updated) {
+                fputc('\n', fp_out);
+            }
+        }
+    }
+    if (!updated) {
+        config_write_flag(fp_out, new_unprivileged, rootfs_idmap);
+    }
+    
+    if (fclose(fp_out) == EOF) {
+        fprintf(stderr, "Error writing temporary file: %s\n", strerror(errno));
+        unlink(temp_path);
+        result = -1;
+    } else if (rename(temp_path, config_path) == -1) {
+        /* Replace original with temporary */
+        fprintf(stderr, "Error replacing config file: %s\n", strerror(errno));
+        unlink(temp_path);
+        result = -1;
+    }
+    
+out:
+    free(temp_path);
+    if (cfg == &fresh) {
+        config_free(&fresh);
+    }
+    return result;
+}
+
+/*
+ * Idmapped mounts (Linux 5.12+): instead of shifting every inode, LXC can
+ * mount the rootfs through the container's id mapping when the config
+ * asks for it, so on-disk ownership stays as it is for a privileged
+ * container. Support depends on the kernel and the filesystem, so it is
+ * probed by idmapping a detached copy of the mount with a throwaway user
+ * namespace that has the container's mapping.
+ */
+static int idmap_mount_supported(const char *path, const lxc_idmap_t *idmap) {
+    char map_path[64], map[MAX_IDMAP_EXTENTS * 36 + 1];
+    struct mount_attr attr;
+    int pipefd[2];
+    int userns = -1, tree = -1;
+    int supported = 0;
+    pid_t pid;
+    
+    if (pipe2(pipefd, O_CLOEXEC) == -1) {
+        return 0;
+    }
+    pid = fork();
+    if (pid == 0) {
+        /* Child: enter a new user namespace and wait to be mapped and killed */
+        char c;
+        close(pipefd[1]);
+        if (unshare(CLONE_NEWUSER) == 0) {
+            (void)read(pipefd[0], &c, 1);
+        }
+        _exit(0);
+    }
+    close(pipefd[0]);
+    if (pid == -1) {
+        close(pipefd[1]);
+        return 0;
+    }
+    
+    /* Wait until the child has left the initial user namespace */
+    snprintf(map_path, sizeof(map_path), "/proc/%d/ns/user", (int)pid);
+    for (int tries = 0; tries < 1000; tries++) {
+        struct stat self, child;
+        if (stat("/proc/self/ns/user", &self) == 0 && stat(map_path, &child) == 0 &&
+            self.st_ino != child.st_ino) {
+            break;
+        }
+        usleep(1000);
+    }
+    
+    for (int i = 0; i < 2; i++) {
+        const id_extent_t *extents = i ? idmap->gid : idmap->uid;
+        int count = i ? idmap->num_gid : idmap->num_uid;
+        size_t len = 0;
+        int fd;
+        
+        if (count == 0) {
+            len = snprintf(map, sizeof(map), "0 %d 65536\n", UID_GID_OFFSET);
+        }
+        for (int k = 0; k < count; k++) {
+            len += snprintf(map + len, sizeof(map) - len, "%u %u %u\n",
+                            extents[k].first, extents[k].target, extents[k].count);
+        }
+        snprintf(map_path, sizeof(map_path), "/proc/%d/%s", (int)pid, i ? "gid_map" : "uid_map");
+        fd = open(map_path, O_WRONLY | O_CLOEXEC);
+        if (fd == -1 || write(fd, map, len) != (ssize_t)len) {
+            if (fd != -1) {
+                close(fd);
+            }
+            goto out;
+        }
+        close(fd);
+    }
+    snprintf(map_path, sizeof(map_path), "/proc/%d/ns/user", (int)pid);
+    userns = open(map_path, O_RDONLY | O_CLOEXEC);
+    if (userns == -1) {
+        goto out;
+    }
+    
+    tree = (int)syscall(__NR_open_tree, AT_FDCWD, path, OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC);
+    if (tree == -1) {
+        goto out;
+    }
+    memset(&attr, 0, sizeof(attr));
+    attr.attr_set = MOUNT_ATTR_IDMAP;
+    attr.userns_fd = userns;
+    supported = syscall(__NR_mount_setattr, tree, "", AT_EMPTY_PATH, &attr, sizeof(attr)) == 0;
+    
+out:
+    if (tree != -1) {
+        close(tree);    /* The detached copy goes away with its descriptor */
+    }
+    if (userns != -1) {
+        close(userns);
+    }
+    close(pipefd[1]);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return supported;
+}
+
+static int compare_ids(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Running containers, found in one pass for all of them instead of probing
+ * per container and forking pct (a Perl interpreter) for each. Two sources
+ * that do not depend on each other: the LXC cgroups, whichever hierarchy
+ * the host uses, and the abstract command socket every running monitor
+ * listens on (@/var/lib/lxc/<id>/command in /proc/net/unix). pct is only
+ * asked when they disagree, e.g. for a container that is starting or
+ * stopping.
+ */
+typedef struct {
+    int *ids;
+    int num;
+    int cap;
+} id_set_t;
+
+static struct {
+    int scanned;
+    int have_sockets;   /* /proc/net/unix was readable */
+    id_set_t cgroups;
+    id_set_t sockets;
+    id_set_t locks;
+} running;
+
+static void id_set_add(id_set_t *set, int id) {
+    if (set->num == set->cap) {
+        int *ids = realloc(set->ids, (set->cap ? set->cap * 2 : 64) * sizeof(int));
+        if (!ids) {
+            return;
+        }
+        set->ids = ids;
+        set->cap = set->cap ? set->cap * 2 : 64;
+    }
+    set->ids[set->num++] = id;
+}
+
+static int id_set_has(const id_set_t *set, int id) {
+    return set->num > 0 && bsearch(&id, set->ids, set->num, sizeof(int), compare_ids);
+}
+
+/* Container ID at the start of name, followed by end, or -1 */
+static int parse_ct_id(const char *name, const char *end) {
+    char *rest;
+    long id;
+    
+    if (!isdigit((unsigned char)*name)) {
+        return -1;
+    }
+    errno = 0;
+    id = strtol(name, &rest, 10);
+    if (errno || id > INT_MAX || strncmp(rest, end, strlen(end)) != 0) {
+        return -1;
+    }
+    return (int)id;
+}
+
+/* Add the IDs named by the entries of dir, after prefix */
+static void running_scan_dir(id_set_t *set, const char *path, const char *prefix) {
+    DIR *dir = opendir(path);
+    struct dirent *de;
+    size_t len = strlen(prefix);
+    
+    if (!dir) {
+        return;
+    }
+    while ((de = readdir(dir))) {
+        int id;
+        if (strncmp(de->d_name, prefix, len) == 0 &&
+            (id = parse_ct_id(de->d_name + len, "")) >= 0) {
+            id_set_add(set, id);
+        }
+    }
+    closedir(dir);
+}
+
+static void running_scan(void) {
+    static const char *const cgroup_dirs[] = {
+        "/sys/fs/cgroup/lxc",                   /* Proxmox, cgroup v2 */
+        "/sys/fs/cgroup/lxc.monitor",
+        "/sys/fs/cgroup/unified/lxc",           /* Hybrid */
+        "/sys/fs/cgroup/systemd/lxc",           /* cgroup v1 */
+        "/sys/fs/cgroup/pids/lxc",
+    };
+    char line[MAX_LINE];
+    FILE *fp;
+    
+    running.scanned = 1;
+    
+    /* Plain LXC on cgroup v2 names them lxc.monitor.<id> and lxc.payload.<id> */
+    running_scan_dir(&running.cgroups, "/sys/fs/cgroup", "lxc.monitor.");
+    running_scan_dir(&running.cgroups, "/sys/fs/cgroup", "lxc.payload.");
+    for (size_t i = 0; i < sizeof(cgroup_dirs) / sizeof(cgroup_dirs[0]); i++) {
+        running_scan_dir(&running.cgroups, cgroup_dirs[i], "");
+    }
+    
+    fp = fopen("/proc/net/unix", "r");
+    if (fp) {
+        running.have_sockets = 1;
+        while (fgets(line, sizeof(line), fp)) {
+            char *name = strstr(line, " @/var/lib/lxc/");
+            int id;
+            if (name && (id = parse_ct_id(name + 15, "/command")) >= 0) {
+                id_set_add(&running.sockets, id);
+            }
+        }
+        fclose(fp);
+    }
+    
+    running_scan_dir(&running.locks, "/var/lock/lxc/var/lib/lxc", "");
+    
+    qsort(running.cgroups.ids, running.cgroups.num, sizeof(int), compare_ids);
+    qsort(running.sockets.ids, running.sockets.num, sizeof(int), compare_ids);
+    qsort(running.locks.ids, running.locks.num, sizeof(int), compare_ids);
+}
+
+/* Check if container is running */
+static int is_container_running(int container_id) {
+    char cmd[128];
+    int cgroup, socket;
+    
+    if (!running.scanned) {
+        running_scan();
+    }
+    cgroup = id_set_has(&running.cgroups, container_id);
+    socket = id_set_has(&running.sockets, container_id);
+    
+    if (cgroup && (socket || !running.have_sockets)) {
+        return 1;
+    }
+    if (cgroup != socket || !running.have_sockets) {
+        /* Check if pct status command works (Proxmox-specific) */
+        snprintf(cmd, sizeof(cmd), "pct status %d 2>/dev/null | grep -q 'status: running'",
+                 container_id);
+        if (system(cmd) == 0) {
+            return 1;
+        }
+        if ((cgroup || socket) && access("/usr/sbin/pct", X_OK) != 0) {
+            /* No pct to settle it, either sign of life counts */
+            return 1;
+        }
+    }
+    
+    /* Check for lock file */
+    return id_set_has(&running.locks, container_id);
+}
+
+/*
+ * A container selected for conversion. Each one has its own config and
+ * paths, but all of their jobs run in one walker pool.
+ */
+typedef struct {
+    int id;
+    char config_path[MAX_PATH_LEN];
+    lxc_config_t config;        /* Paths and id map, kept for the rewrite */
+    int selected;               /* Takes part in the conversion */
+    int running;                /* Running, allowed with --zfs-clone */
+    int rootfs_idmap;           /* ROOTFS_IDMAP_*, non-zero leaves the rootfs alone */
+    id_mapping_t map;           /* Compiled for the conversion */
+    int failed;
+    int verify_only;            /* Already in the target state, only verified */
+    journal_t journal;
+    const char *status;         /* Outcome, for the batch summary */
+} container_t;
+
+typedef struct {
+    int lo, hi;
+} id_range_t;
+
+/* Parse a container list like "101,102,200-250" */
+static int parse_id_list(const char *list, id_range_t *ranges, int *num_ranges) {
+    const char *p = list;
+    
+    *num_ranges = 0;
+    while (*p) {
+        char *end;
+        long lo, hi;
+        
+        lo = strtol(p, &end, 10);
+        if (end == p || lo <= 0) {
+            fprintf(stderr, "Error: Invalid container list: %s\n", list);
+            return -1;
+        }
+        hi = lo;
+        p = end;
+        if (*p == '-') {
+            p++;
+            hi = strtol(p, &end, 10);
+            if (end == p || hi < lo) {
+                fprintf(stderr, "Error: Invalid container range in: %s\n", list);
+                return -1;
+            }
+            p = end;
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p) {
+            fprintf(stderr, "Error: Invalid container list: %s\n", list);
+            return -1;
+        }
+        if (*num_ranges >= MAX_BATCH_RANGES) {
+            fprintf(stderr, "Error: Too many entries in container list\n");
+            return -1;
+        }
+        ranges[*num_ranges].lo = (int)lo;
+        ranges[*num_ranges].hi = hi > INT_MAX ? INT_MAX : (int)hi;
+        (*num_ranges)++;
+    }
+    return *num_ranges > 0 ? 0 : -1;
+}
+
+/*
+ * Find the configured containers matching a list. The config directory is
+ * scanned once, so ranges may cover IDs that do not exist; single IDs must.
+ */
+static int *find_containers(const id_range_t *ranges, int num_ranges, int *count) {
+    DIR *dir;
+    struct dirent *de;
+    int *ids = NULL;
+    int num = 0, cap = 0;
+    
+    dir = opendir(LXC_CONFIG_DIR);
+    if (!dir) {
+        fprintf(stderr, "Error opening %s: %s\n", LXC_CONFIG_DIR, strerror(errno));
+        return NULL;
+    }
+    while ((de = readdir(dir))) {
+        char *end;
+        long id = strtol(de->d_name, &end, 10);
+        
+        if (end == de->d_name || strcmp(end, ".conf") != 0 || id <= 0 || id > INT_MAX) {
+            continue;
+        }
+        for (int i = 0; i < num_ranges; i++) {
+            if (id >= ranges[i].lo && id <= ranges[i].hi) {
+                if (num == cap) {
+                    int *grown = realloc(ids, (cap ? cap * 2 : 64) * sizeof(int));
+                    if (!grown) {
+                        fprintf(stderr, "Failed to allocate memory for container list\n");
+                        free(ids);
+                        closedir(dir);
+                        return NULL;
+                    }
+                    ids = grown;
+                    cap = cap ? cap * 2 : 64;
+                }
+                ids[num++] = (int)id;
+                break;
+            }
+        }
+    }
+    closedir(dir);
+    
+    qsort(ids, num, sizeof(int), compare_ids);
+    for (int i = 0; i < num_ranges; i++) {
+        if (ranges[i].lo == ranges[i].hi &&
+            !(num > 0 && bsearch(&ranges[i].lo, ids, num, sizeof(int), compare_ids))) {
+            fprintf(stderr, "Error: No configuration for container %d\n", ranges[i].lo);
+            free(ids);
+            return NULL;
+        }
+    }
+    if (num == 0) {
+        fprintf(stderr, "Error: No containers match the list\n");
+        free(ids);
+        return NULL;
+    }
+    *count = num;
+    return ids;
+}
+
+/*
+ * Nested mounts (--nested-mounts). The walker does not cross into other
+ * filesystems, so child ZFS datasets of a subvol and other filesystems
+ * mounted below a container path are left alone. With the option they are
+ * looked up in mountinfo and added to the container's paths, so each runs
+ * as a job of its own next to its parent. Only filesystems that belong to
+ * the container are taken: datasets below the path's own dataset, and
+ * block device filesystems mounted whole. Pseudo filesystems, network and
+ * FUSE mounts and bind mounts of a directory are skipped, as is anything
+ * on the device of a path already listed. Nothing is looked up below a
+ * rootfs that is an idmapped mount, which is not converted either.
+ */
+static int nested_accept(const char *parent_dataset, const char *root, const char *fstype,
+                         const char *source) {
+    if (strcmp(fstype, "zfs") == 0) {
+        size_t len = strlen(parent_dataset);
+        return len > 0 && strncmp(source, parent_dataset, len) == 0 && source[len] == '/';
+    }
+    return strcmp(root, "/") == 0 && strncmp(source, "/dev/", 5) == 0 &&
+           (strcmp(fstype, "ext4") == 0 || strcmp(fstype, "ext3") == 0 ||
+            strcmp(fstype, "ext2") == 0 || strcmp(fstype, "xfs") == 0 ||
+            strcmp(fstype, "btrfs") == 0);
+}
+
+/* Append the nested mounts below the configured paths to them */
+static int container_nested(container_t *ct) {
+    lxc_config_t *cfg = &ct->config;
+    int num_config = cfg->num_paths;
+    int skip_rootfs = ct->rootfs_idmap == ROOTFS_IDMAP_ADD ||
+                      cfg->rootfs_options == ROOTFS_OPTIONS_IDMAP;
+    char line[MAX_LINE];
+    dev_t *devs;
+    FILE *fp;
+    int num_devs = 0;
+    int found = 0;
+    
+    if (!g_nested || !(fp = fopen("/proc/self/mountinfo", "r"))) {
+        return 0;
+    }
+    devs = malloc(num_config * sizeof(dev_t));
+    if (!devs) {
+        ct->status = "out of memory";
+        fclose(fp);
+        return -1;
+    }
+    for (int i = 0; i < num_config; i++) {
+        struct stat st;
+        if (stat(cfg->paths[i], &st) == 0) {
+            devs[num_devs++] = st.st_dev;
+        }
+    }
+    
+    for (int i = 0; i < num_config; i++) {
+        const char *path = cfg->paths[i];
+        char dataset[MAX_PATH_LEN] = "";
+        size_t len = strlen(path);
+        
+        if (skip_rootfs && i == cfg->rootfs_index) {
+            continue;
+        }
+        while (len > 1 && path[len - 1] == '/') {
+            len--;
+        }
+        zfs_dataset(path, dataset, sizeof(dataset));
+        
+        rewind(fp);
+        while (fgets(line, sizeof(line), fp)) {
+            char root[MAX_PATH_LEN], mountpoint[MAX_PATH_LEN], source[MAX_PATH_LEN], fstype[64];
+            char *sep = strstr(line, " - ");
+            struct stat st;
+            char **grown;
+            dev_t *grown_devs;
+            int known = 0;
+            
+            /* "<id> <parent> <major>:<minor> <root> <mountpoint> <opts> ... - <type> <source> ..." */
+            if (!sep || sscanf(line, "%*d %*d %*s %2047s %2047s", root, mountpoint) != 2 ||
+                sscanf(sep + 3, "%63s %2047s", fstype, source) != 2) {
+                continue;
+            }
+            unescape_octal(root, 3);
+            unescape_octal(mountpoint, 3);
+            unescape_octal(source, 3);
+            if (strncmp(mountpoint, path, len) != 0 || mountpoint[len] != '/') {
+                continue;
+            }
+            if (!nested_accept(dataset, root, fstype, source)) {
+                printf("Skipping nested mount %s (%s %s)\n", mountpoint, fstype, source);
+                continue;
+            }
+            if (stat(mountpoint, &st) == -1) {
+                fprintf(stderr, "Warning: cannot stat nested mount %s: %s\n", mountpoint,
+                        strerror(errno));
+                continue;
+            }
+            for (int k = 0; k < num_devs; k++) {
+                known |= devs[k] == st.st_dev;
+            }
+            if (known) {
+                continue;
+            }
+            
+            grown = realloc(cfg->paths, (cfg->num_paths + 1) * sizeof(char *));
+            if (grown) {
+                cfg->paths = grown;
+            }
+            grown_devs = realloc(devs, (num_devs + 1) * sizeof(dev_t));
+            if (grown_devs) {
+                devs = grown_devs;
+            }
+            if (!grown || !grown_devs || !(cfg->paths[cfg->num_paths] = strdup(mountpoint))) {
+                fprintf(stderr, "Failed to allocate memory for paths\n");
+                ct->status = "out of memory";
+                free(devs);
+                fclose(fp);
+                return -1;
+            }
+            cfg->num_paths++;
+            devs[num_devs++] = st.st_dev;
+            if (found++ == 0) {
+                printf("Found nested mounts:\n");
+            }
+            printf("  [%d] %s (%s)\n", cfg->num_paths, mountpoint, source);
+        }
+    }
+    free(devs);
+    fclose(fp);
+    return 0;
+}
+
+/*
+ * Check a container and read its config. Returns -1 if it cannot be
+ * converted, 1 if it is already in the target state and 0 if it is ready.
+ */
+static int load_container(container_t *ct, int target_unprivileged) {
+    /* Check if container is running */
+    if (is_container_running(ct->id)) {
+        if (g_dry_run) {
+            printf("Container %d is running, the census may not match the stopped state.\n",
+                   ct->id);
+        } else if (!g_zfs_clone) {
+            fprintf(stderr, "Error: Container %d is currently running!\n", ct->id);
+            fprintf(stderr, "Please stop the container before conversion:\n");
+            fprintf(stderr, "  pct stop %d\n", ct->id);
+            ct->status = "running, skipped";
+            return -1;
+        }
+        printf("Container %d is running, it is stopped after the bulk conversion.\n", ct->id);
+        ct->running = 1;
+    }
+    
+    /* Construct config path */
+    snprintf(ct->config_path, sizeof(ct->config_path), LXC_CONFIG_DIR "/%d.conf", ct->id);
+    
+    /* Read configuration */
+    printf("Reading configuration from: %s\n", ct->config_path);
+    if (config_read(ct->config_path, &ct->config) == -1 ||
+        id_mapping_init(&ct->map, &ct->config.idmap, target_unprivileged) == -1) {
+        ct->status = "config error";
+        return -1;
+    }
+    for (int i = 0; i < ct->config.idmap.num_uid; i++) {
+        printf("%s u %u %u %u\n", i ? "        " : "UID map:", ct->config.idmap.uid[i].first,
+               ct->config.idmap.uid[i].target, ct->config.idmap.uid[i].count);
+    }
+    for (int i = 0; i < ct->config.idmap.num_gid; i++) {
+        printf("%s g %u %u %u\n", i ? "        " : "GID map:", ct->config.idmap.gid[i].first,
+               ct->config.idmap.gid[i].target, ct->config.idmap.gid[i].count);
+    }
+    
+    if (ct->config.num_paths == 0) {
+        fprintf(stderr, "Error: No filesystems found in configuration\n");
+        ct->status = "no filesystems";
+        return -1;
+    }
+    
+    printf("Found %d filesystem(s) to convert\n", ct->config.num_paths);
+    for (int i = 0; i < ct->config.num_paths; i++) {
+        printf("  [%d] %s\n", i+1, ct->config.paths[i]);
+    }
+    
+    /* Check current state */
+    if (ct->config.current_unprivileged != -1) {
+        printf("\nCurrent state: %s\n", ct->config.current_unprivileged ? "unprivileged" : "privileged");
+        printf("Target state:  %s\n", target_unprivileged ? "unprivileged" : "privileged");
+        
+        if (ct->config.current_unprivileged == target_unprivileged) {
+            printf("\nContainer is already in the target state!\n");
+            if (g_dry_run || g_idempotent) {
+                printf("Checking for entries that still need converting.\n");
+                return container_nested(ct);
+            }
+            if (g_verify > 0) {
+                printf("Verifying its filesystems only.\n");
+                ct->verify_only = 1;
+                return container_nested(ct);
+            }
+            ct->status = "already converted";
+            return 1;
+        }
+    }
+    
+    /* An idmapped rootfs was never shifted, going back only drops the option */
+    if (ct->config.rootfs_index >= 0 && ct->config.rootfs_options == ROOTFS_OPTIONS_IDMAP &&
+        !target_unprivileged) {
+        printf("Rootfs is an idmapped mount, its ownership is left unchanged.\n");
+        ct->rootfs_idmap = ROOTFS_IDMAP_REMOVE;
+    } else if (g_idmap_mount && ct->config.rootfs_index >= 0 && target_unprivileged) {
+        const char *rootfs = ct->config.paths[ct->config.rootfs_index];
+        
+        if (ct->config.rootfs_options != ROOTFS_OPTIONS_NONE) {
+            printf("Rootfs already has lxc.rootfs.options, converting it in place.\n");
+        } else if (!idmap_mount_supported(rootfs, &ct->config.idmap)) {
+            printf("Idmapped mounts are not supported for %s, converting it in place.\n",
+                   rootfs);
+        } else {
+            printf("Rootfs will be an idmapped mount (" ROOTFS_IDMAP_OPTION "), "
+                   "its ownership is left unchanged.\n");
+            ct->rootfs_idmap = ROOTFS_IDMAP_ADD;
+        }
+    }
+    
+    return container_nested(ct);
+}
+
+/*
+ * Verify the filesystems of every container that converted cleanly (or is
+ * only verified) in one walker pool. A container with entries outside the
+ * target range fails; its journal is dropped, since the subtrees it lists
+ * as done are exactly what has to be walked again.
+ */
+static void verify_containers(container_t *cts, int num_cts, int target_unprivileged) {
+    convert_job_t *jobs;
+    int num_jobs = 0;
+    
+    for (int i = 0; i < num_cts; i++) {
+        num_jobs += cts[i].selected && !cts[i].failed ? cts[i].config.num_paths : 0;
+    }
+    if (num_jobs == 0 || !(jobs = calloc(num_jobs, sizeof(convert_job_t)))) {
+        return;
+    }
+    
+    num_jobs = 0;
+    for (int i = 0; i < num_cts; i++) {
+        container_t *ct = &cts[i];
+        
+        for (int k = 0; ct->selected && !ct->failed && k < ct->config.num_paths; k++) {
+            /* A rootfs kept privileged behind an idmapped mount has nothing to check */
+            if (k == ct->config.rootfs_index &&
+                (ct->rootfs_idmap == ROOTFS_IDMAP_ADD ||
+                 (ct->verify_only && target_unprivileged &&
+                  ct->config.rootfs_options == ROOTFS_OPTIONS_IDMAP))) {
+                continue;
+            }
+            if (job_init(&jobs[num_jobs], ct->config.paths[k], 0, &ct->map, i, NULL) == -1) {
+                ct->failed = 1;
+                continue;
+            }
+            jobs[num_jobs].idempotent = 0;
+            jobs[num_jobs].verify = 1;
+            num_jobs++;
+        }
+    }
+    
+    if (g_verify < 100) {
+        printf("\nVerifying %g%% of the directories...\n", g_verify);
+    } else {
+        printf("\nVerifying...\n");
+    }
+    free_inode_table();
+    g_verify_seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+    convert_jobs(jobs, num_jobs);
+    
+    for (int i = 0; i < num_jobs; i++) {
+        container_t *ct = &cts[jobs[i].container];
+        
+        if (jobs[i].result != 0 && !ct->failed) {
+            fprintf(stderr, "\nContainer %d: verification failed.\n", ct->id);
+            if (!ct->verify_only) {
+                fprintf(stderr, "Run the conversion again with --idempotent to convert "
+                        "what was missed.\n");
+            }
+            ct->failed = 1;
+            ct->status = "verification failed";
+            journal_close(&ct->journal, 1);
+        }
+    }
+    free(jobs);
+}
+
+/*
+ * Undo (--undo): replay a change log. Entry records are split into one
+ * contiguous chunk per thread. Each thread reopens an entry by its file
+ * handle, which needs neither getdents nor path lookups and fails with
+ * ESTALE once the inode was deleted, even if its number was reused. On
+ * filesystems without handles it opens the parent directory component by
+ * component without following symlinks (reusing it for the next entry in
+ * the same directory). It then checks that the inode is the one that was
+ * logged, and restores ACLs, ownership and setuid/setgid bits through an
+ * O_PATH descriptor. Only logged inodes are touched.
+ */
+typedef struct {
+    int id;
+    int unprivileged;           /* State before the logged conversion */
+    int rootfs_idmap;           /* ROOTFS_IDMAP_* that conversion applied */
+    char config_path[MAX_PATH_LEN];
+    uint64_t errors;
+} undo_container_t;
+
+typedef struct {
+    const char *map;            /* The log, mapped */
+    size_t size;
+    const changelog_rec_t **entries;
+    size_t num_entries;
+    int *root_fds;
+    dev_t *root_devs;
+    uint32_t *root_containers;
+    uint32_t num_roots;
+    undo_container_t *containers;
+    uint32_t num_containers;
+    uint64_t restored;          /* Atomic */
+    uint64_t changed;           /* Inode replaced since, atomic */
+} undo_t;
+
+typedef struct {
+    undo_t *undo;
+    size_t begin, end;
+    pthread_t thread;
+} undo_worker_t;
+
+/* Open dir below rootfd, refusing symlinks and ".." on the way */
+static int undo_open_dir(int rootfd, const char *dir) {
+    char buf[PATH_MAX];
+    char *save = NULL;
+    int fd = rootfd;
+    
+    if (snprintf(buf, sizeof(buf), "%s", dir) >= (int)sizeof(buf)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    for (char *comp = strtok_r(buf, "/", &save); comp; comp = strtok_r(NULL, "/", &save)) {
+        int next;
+        
+        if (strcmp(comp, "..") == 0) {
+            errno = EPERM;
+            next = -1;
+        } else {
+            next = openat(fd, comp, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        }
+        if (fd != rootfd) {
+            close(fd);
+        }
+        if (next == -1) {
+            return -1;
+        }
+        fd = next;
     }
-    
-    printf("\rProcessed %"PRIu64" files (errors: %"PRIu64")    \n", 
-           g_files_processed, g_errors);
-    
-    return g_errors > 0 ? -1 : 0;
+    return fd == rootfd ? openat(rootfd, ".", O_PATH | O_DIRECTORY | O_CLOEXEC) : fd;
 }
 
-/* Parse a storage specification and convert to actual path */
-static int parse_storage_path(const char *storage_spec, char *path_out, size_t path_len) {
-    /* Check if it's a ZFS volume (format: pool:subvol) or directory (starts with /) */
-    if (storage_spec[0] == '/') {
-        /* Direct directory path */
-        snprintf(path_out, path_len, "%s", storage_spec);
-        return 0;
+/* Open a logged entry by path below its root, O_PATH and not following symlinks */
+static int undo_open_path(undo_t *u, const changelog_rec_t *rec, const char *rel,
+                          char *dir_cache, int *dir_fd, uint32_t *dir_root) {
+    const char *base = strrchr(rel, '/');
+    int rootfd = u->root_fds[rec->root];
+    int parent;
+    
+    /* Entries of one directory are usually logged together */
+    if (!base) {
+        parent = rootfd;
+        base = rel;
     } else {
-        /* Assume ZFS format: pool:subvol -> /pool/subvol */
-        char pool[256], subvol[512];
-        if (sscanf(storage_spec, "%255[^:]:%511s", pool, subvol) == 2) {
-            snprintf(path_out, path_len, "/%s/%s", pool, subvol);
-            return 0;
+        size_t len = base - rel;
+        
+        if (*dir_fd == -1 || *dir_root != rec->root || strncmp(dir_cache, rel, len) != 0 ||
+            dir_cache[len] != '\0') {
+            if (*dir_fd != -1) {
+                close(*dir_fd);
+            }
+            memcpy(dir_cache, rel, len);
+            dir_cache[len] = '\0';
+            *dir_root = rec->root;
+            *dir_fd = undo_open_dir(rootfd, dir_cache);
         }
+        if (*dir_fd == -1) {
+            return -1;
+        }
+        parent = *dir_fd;
+        base++;
     }
-    
-    fprintf(stderr, "Error: Could not parse storage specification: %s\n", storage_spec);
-    return -1;
+    return *base ? openat(parent, base, O_PATH | O_NOFOLLOW | O_CLOEXEC) :
+                   openat(rootfd, ".", O_PATH | O_CLOEXEC);
 }
 
-/* Extract storage specification from config line */
-static int extract_storage_spec(const char *line, char *spec_out, size_t spec_len) {
-    const char *start = strchr(line, ':');
-    if (!start) return -1;
-    start++; /* Skip the colon */
+static int undo_entry(undo_t *u, const changelog_rec_t *rec, char *dir_cache, int *dir_fd,
+                      uint32_t *dir_root) {
+    static const char *const acl_names[2] = { ACL_XATTR_ACCESS, ACL_XATTR_DEFAULT };
+    char rel[PATH_MAX], procpath[64];
+    const char *data = (const char *)(rec + 1) + rec->path_len;
+    struct stat st;
+    int fd = -1;
+    int result = 0;
     
-    /* Skip whitespace */
-    while (*start && isspace(*start)) start++;
+    memcpy(rel, rec + 1, rec->path_len);
+    rel[rec->path_len] = '\0';
     
-    /* Extract up to comma or end of line */
-    const char *end = strchr(start, ',');
-    size_t len;
-    if (end) {
-        len = end - start;
-    } else {
-        len = strlen(start);
-        /* Remove trailing whitespace */
-        while (len > 0 && isspace(start[len-1])) len--;
+    if (rec->handle_len > 0) {
+        union {
+            struct file_handle fh;
+            char buf[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+        } handle;
+        
+        handle.fh.handle_type = rec->handle_type;
+        handle.fh.handle_bytes = rec->handle_len;
+        memcpy(handle.fh.f_handle, data, rec->handle_len);
+        fd = open_by_handle_at(u->root_fds[rec->root], &handle.fh, O_PATH | O_CLOEXEC);
+        if (fd == -1 && errno == ESTALE) {
+            __atomic_add_fetch(&u->changed, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
     }
-    
-    if (len >= spec_len) {
-        fprintf(stderr, "Error: Storage specification too long\n");
+    data += rec->handle_len;
+    if (fd == -1) {
+        fd = undo_open_path(u, rec, rel, dir_cache, dir_fd, dir_root);
+    }
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "Error opening %s: %s\n", rel, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
         return -1;
     }
+    /* Inode numbers are reused, a different type is also a new entry */
+    if (st.st_ino != rec->ino || st.st_dev != u->root_devs[rec->root] ||
+        (st.st_mode & S_IFMT) != (rec->mode & S_IFMT)) {
+        __atomic_add_fetch(&u->changed, 1, __ATOMIC_RELAXED);
+        close(fd);
+        return 0;
+    }
+    snprintf(procpath, sizeof(procpath), "/proc/self/fd/%d", fd);
     
-    strncpy(spec_out, start, len);
-    spec_out[len] = '\0';
-    
-    return 0;
+    for (int i = 0; i < 2; i++) {
+        if (rec->acl_len[i] > 0 && setxattr(procpath, acl_names[i], data, rec->acl_len[i], 0) == -1) {
+            fprintf(stderr, "Error restoring ACL of %s: %s\n", rel, strerror(errno));
+            result = -1;
+        }
+        data += rec->acl_len[i];
+    }
+    if (fchownat(fd, "", rec->uid, rec->gid, AT_EMPTY_PATH) == -1) {
+        fprintf(stderr, "Error restoring ownership of %s: %s\n", rel, strerror(errno));
+        result = -1;
+    } else if (!S_ISLNK(st.st_mode) && (rec->mode & (S_ISUID | S_ISGID)) &&
+               (st.st_mode & 0777) == (rec->mode & 0777) &&
+               chmod(procpath, rec->mode & 07777) == -1) {
+        fprintf(stderr, "Error restoring mode of %s: %s\n", rel, strerror(errno));
+        result = -1;
+    }
+    close(fd);
+    if (result == 0) {
+        __atomic_add_fetch(&u->restored, 1, __ATOMIC_RELAXED);
+    }
+    return result;
 }
 
-/* Read config file and extract paths */
-static int read_config(const char *config_path, char paths[][MAX_PATH_LEN], 
-                      int *num_paths, int *current_unprivileged) {
-    FILE *fp;
-    char line[MAX_LINE];
+static void *undo_thread(void *arg) {
+    undo_worker_t *worker = arg;
+    undo_t *u = worker->undo;
+    char dir_cache[PATH_MAX];
+    uint32_t dir_root = 0;
+    int dir_fd = -1;
     
-    *num_paths = 0;
-    *current_unprivileged = -1;
+    for (size_t i = worker->begin; i < worker->end; i++) {
+        const changelog_rec_t *rec = u->entries[i];
+        
+        if (undo_entry(u, rec, dir_cache, &dir_fd, &dir_root) == -1) {
+            __atomic_add_fetch(&u->containers[u->root_containers[rec->root]].errors, 1,
+                               __ATOMIC_RELAXED);
+        }
+    }
+    if (dir_fd != -1) {
+        close(dir_fd);
+    }
+    return NULL;
+}
+
+/* Index the records of a mapped change log, -1 if it is damaged */
+static int undo_parse(undo_t *u) {
+    const changelog_header_t *header = (const changelog_header_t *)u->map;
+    size_t off = sizeof(*header);
+    size_t cap_entries = 0, cap_roots = 0;
     
-    fp = fopen(config_path, "r");
-    if (!fp) {
-        fprintf(stderr, "Error opening config file %s: %s\n", 
-                config_path, strerror(errno));
+    if (u->size < sizeof(*header) || header->magic != CHANGELOG_MAGIC ||
+        header->version != CHANGELOG_VERSION) {
+        fprintf(stderr, "Error: not a change log\n");
         return -1;
     }
-    
-    while (fgets(line, sizeof(line), fp)) {
-        /* Remove trailing newline */
-        char *newline = strchr(line, '\n');
-        if (newline) *newline = '\0';
+    while (off < u->size) {
+        const changelog_rec_t *rec = (const changelog_rec_t *)(u->map + off);
+        size_t size;
         
-        /* Stop at snapshot sections (lines starting with '[') */
-        if (line[0] == '[') {
+        if (u->size - off < sizeof(*rec) ||
+            (size = changelog_rec_size(rec)) > u->size - off) {
+            fprintf(stderr, "Warning: change log ends in a partial record, ignoring it\n");
             break;
         }
+        off += size;
         
-        /* Check for unprivileged flag */
-        if (strncmp(line, "unprivileged:", 13) == 0) {
-            char *value = line + 13;
-            while (*value && isspace(*value)) value++;
-            *current_unprivileged = atoi(value);
-            continue;
-        }
-        
-        /* Check for rootfs or mp entries */
-        if (strncmp(line, "rootfs:", 7) == 0 || 
-            (strncmp(line, "mp", 2) == 0 && strchr(line, ':'))) {
+        if (rec->type == CHANGELOG_CONTAINER) {
+            undo_container_t *ct;
+            void *grown = realloc(u->containers, (u->num_containers + 1) * sizeof(*ct));
             
-            char storage_spec[512];
-            char temp_path[MAX_PATH_LEN];
+            if (!grown) {
+                return -1;
+            }
+            u->containers = grown;
+            ct = &u->containers[u->num_containers++];
+            memset(ct, 0, sizeof(*ct));
+            ct->id = (int)rec->uid;
+            ct->unprivileged = (int)rec->gid;
+            ct->rootfs_idmap = (int)rec->mode;
+            snprintf(ct->config_path, sizeof(ct->config_path), "%.*s", (int)rec->path_len,
+                     (const char *)(rec + 1));
+        } else if (rec->type == CHANGELOG_ROOT) {
+            char path[MAX_PATH_LEN];
+            struct stat st;
+            int fd;
             
-            if (extract_storage_spec(line, storage_spec, sizeof(storage_spec)) == 0) {
-                if (*num_paths >= MAX_PATHS) {
-                    fprintf(stderr, "Error: Too many mount points\n");
-                    fclose(fp);
+            if (rec->root >= u->num_containers) {
+                fprintf(stderr, "Error: change log is damaged\n");
+                return -1;
+            }
+            if (u->num_roots == cap_roots) {
+                cap_roots = cap_roots ? 2 * cap_roots : 16;
+                if (!(u->root_fds = realloc(u->root_fds, cap_roots * sizeof(int))) ||
+                    !(u->root_devs = realloc(u->root_devs, cap_roots * sizeof(dev_t))) ||
+                    !(u->root_containers = realloc(u->root_containers,
+                                                   cap_roots * sizeof(uint32_t)))) {
                     return -1;
                 }
+            }
+            /* Not O_PATH, open_by_handle_at takes it as the mount */
+            snprintf(path, sizeof(path), "%.*s", (int)rec->path_len, (const char *)(rec + 1));
+            fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd == -1 || fstat(fd, &st) == -1) {
+                fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+                return -1;
+            }
+            u->root_fds[u->num_roots] = fd;
+            u->root_devs[u->num_roots] = st.st_dev;
+            u->root_containers[u->num_roots++] = rec->root;
+            printf("  %s\n", path);
+        } else if (rec->type == CHANGELOG_ENTRY) {
+            if (rec->root >= u->num_roots) {
+                fprintf(stderr, "Error: change log is damaged\n");
+                return -1;
+            }
+            if (u->num_entries == cap_entries) {
+                const changelog_rec_t **grown;
                 
-                if (parse_storage_path(storage_spec, temp_path, MAX_PATH_LEN) == 0) {
-                    /* Check for duplicates */
-                    int is_duplicate = 0;
-                    for (int i = 0; i < *num_paths; i++) {
-                        if (strcmp(paths[i], temp_path) == 0) {
-                            is_duplicate = 1;
-                            break;
-                        }
-                    }
-                    
-                    /* Only add if not a duplicate */
-                    if (!is_duplicate) {
-                        strncpy(paths[*num_paths], temp_path, MAX_PATH_LEN);
-                        paths[*num_paths][MAX_PATH_LEN - 1] = '\0';
-                        (*num_paths)++;
-                    }
+                cap_entries = cap_entries ? 2 * cap_entries : 4096;
+                grown = realloc(u->entries, cap_entries * sizeof(*grown));
+                if (!grown) {
+                    return -1;
                 }
+                u->entries = grown;
             }
+            u->entries[u->num_entries++] = rec;
         }
     }
-    
-    fclose(fp);
-    
-    if (*current_unprivileged == -1) {
-        fprintf(stderr, "Warning: Could not find 'unprivileged' flag in config\n");
-    }
-    
     return 0;
 }
 
-/* Update the unprivileged flag in the config file */
-static int update_config(const char *config_path, int new_unprivileged) {
-    FILE *fp_in, *fp_out;
-    char line[MAX_LINE];
-    char temp_path[MAX_PATH_LEN + 8]; /* +8 for ".tmp" and safety */
-    int updated = 0;
+/* Restore everything a change log recorded, then the configs */
+static int undo_changes(const char *log_path, int assume_yes) {
+    undo_t u;
+    undo_worker_t *workers;
+    struct stat st;
+    int fd, num_workers, started = 0;
+    int result = 0;
     
-    /* Create temporary file */
-    snprintf(temp_path, sizeof(temp_path), "%s.tmp", config_path);
-    if (strlen(config_path) > MAX_PATH_LEN - 5) {
-        fprintf(stderr, "Error: Config path too long\n");
-        return -1;
+    memset(&u, 0, sizeof(u));
+    if (geteuid() != 0) {
+        fprintf(stderr, "Error: This program must be run as root\n");
+        return 1;
     }
-    
-    fp_in = fopen(config_path, "r");
-    if (!fp_in) {
-        fprintf(stderr, "Error opening config file for reading: %s\n", strerror(errno));
-        return -1;
+    fd = open(log_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "Error opening change log %s: %s\n", log_path, strerror(errno));
+        return 1;
     }
-    
-    fp_out = fopen(temp_path, "w");
-    if (!fp_out) {
-        fprintf(stderr, "Error creating temporary file: %s\n", strerror(errno));
-        fclose(fp_in);
-        return -1;
+    u.size = st.st_size;
+    u.map = u.size ? mmap(NULL, u.size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (u.map == MAP_FAILED) {
+        fprintf(stderr, "Error reading change log %s: %s\n", log_path,
+                u.size ? strerror(errno) : "empty file");
+        return 1;
     }
+    madvise((void *)u.map, u.size, MADV_SEQUENTIAL);
     
-    /* Copy file, updating unprivileged flag in main section only */
-    int in_snapshot = 0;
-    while (fgets(line, sizeof(line), fp_in)) {
-        /* Detect snapshot sections */
-        if (line[0] == '[') {
-            /* If we haven't updated yet and entering snapshots, add it now */
-            if (!updated && !in_snapshot) {
-                fprintf(fp_out, "unprivileged: %d\n", new_unprivileged);
-                updated = 1;
-            }
-            in_snapshot = 1;
-            fputs(line, fp_out);
-        } else if (!in_snapshot && strncmp(line, "unprivileged:", 13) == 0) {
-            /* Update unprivileged flag in main section */
-            fprintf(fp_out, "unprivileged: %d\n", new_unprivileged);
-            updated = 1;
-        } else {
-            fputs(line, fp_out);
+    printf("Reading change log %s\n", log_path);
+    if (undo_parse(&u) == -1) {
+        result = 1;
+        goto out;
+    }
+    printf("%zu changed entries in %u filesystem(s) of %u container(s)\n",
+           u.num_entries, u.num_roots, u.num_containers);
+    for (uint32_t i = 0; i < u.num_containers; i++) {
+        if (is_container_running(u.containers[i].id)) {
+            fprintf(stderr, "Error: Container %d is currently running!\n", u.containers[i].id);
+            result = 1;
+            goto out;
         }
     }
     
-    /* If unprivileged flag wasn't found and no snapshots, add it at the end */
-    if (!updated) {
-        fprintf(fp_out, "unprivileged: %d\n", new_unprivileged);
+    if (!assume_yes) {
+        printf("\nRestore ownership, ACLs and configs as they were before? [y/N] ");
+        fflush(stdout);
+        
+        char answer[10];
+        if (!fgets(answer, sizeof(answer), stdin) ||
+            (answer[0] != 'y' && answer[0] != 'Y')) {
+            printf("Aborted.\n");
+            goto out;
+        }
     }
     
-    fclose(fp_in);
-    fclose(fp_out);
-    
-    /* Replace original with temporary */
-    if (rename(temp_path, config_path) == -1) {
-        fprintf(stderr, "Error replacing config file: %s\n", strerror(errno));
-        unlink(temp_path);
-        return -1;
+    num_workers = walker_jobs();
+    workers = calloc(num_workers, sizeof(undo_worker_t));
+    if (!workers) {
+        fprintf(stderr, "Failed to allocate undo threads\n");
+        result = 1;
+        goto out;
     }
-    
-    return 0;
-}
-
-/* Check if container is running */
-static int is_container_running(int container_id) {
-    char path[512];
-    DIR *dir;
-    
-    /* Check multiple cgroup locations for running container */
-    /* Try cgroup v2 first (modern systems) */
-    snprintf(path, sizeof(path), "/sys/fs/cgroup/lxc.monitor.%d", container_id);
-    dir = opendir(path);
-    if (dir) {
-        closedir(dir);
-        return 1;
+    for (int i = 0; i < num_workers; i++) {
+        workers[i].undo = &u;
+        workers[i].begin = u.num_entries * i / num_workers;
+        workers[i].end = u.num_entries * (i + 1) / num_workers;
     }
-    
-    /* Try cgroup v1 systemd path */
-    snprintf(path, sizeof(path), "/sys/fs/cgroup/systemd/lxc/%d", container_id);
-    dir = opendir(path);
-    if (dir) {
-        closedir(dir);
-        return 1;
+    for (; started < num_workers; started++) {
+        if (pthread_create(&workers[started].thread, NULL, undo_thread, &workers[started]) != 0) {
+            break;
+        }
     }
-    
-    /* Try alternative cgroup v1 path */
-    snprintf(path, sizeof(path), "/sys/fs/cgroup/lxc/%d", container_id);
-    dir = opendir(path);
-    if (dir) {
-        closedir(dir);
-        return 1;
+    if (started == 0) {
+        workers[0].end = u.num_entries;
+        undo_thread(&workers[0]);
     }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    free(workers);
     
-    /* Check if pct status command works (Proxmox-specific) */
-    snprintf(path, sizeof(path), "pct status %d 2>/dev/null | grep -q 'status: running'", container_id);
-    if (system(path) == 0) {
-        return 1;
+    printf("Restored %"PRIu64" entries", u.restored);
+    if (u.changed > 0) {
+        printf(", %"PRIu64" were replaced since and left alone", u.changed);
     }
+    printf("\n");
     
-    /* Check for lock file */
-    snprintf(path, sizeof(path), "/var/lock/lxc/var/lib/lxc/%d", container_id);
-    if (access(path, F_OK) == 0) {
-        return 1;
+    /* Back to the previous state, and drop what described the conversion */
+    for (uint32_t i = 0; i < u.num_containers; i++) {
+        undo_container_t *ct = &u.containers[i];
+        int rootfs_idmap = ct->rootfs_idmap == ROOTFS_IDMAP_ADD ? ROOTFS_IDMAP_REMOVE :
+                           ct->rootfs_idmap == ROOTFS_IDMAP_REMOVE ? ROOTFS_IDMAP_ADD :
+                           ROOTFS_IDMAP_KEEP;
+        char path[MAX_PATH_LEN];
+        
+        if (ct->errors > 0) {
+            fprintf(stderr, "Container %d: %"PRIu64" entries could not be restored, "
+                    "NOT updating configuration file.\n", ct->id, ct->errors);
+            result = 1;
+            continue;
+        }
+        if (update_config(ct->config_path, NULL, ct->unprivileged, rootfs_idmap) == -1) {
+            fprintf(stderr, "Error updating configuration file %s\n", ct->config_path);
+            result = 1;
+            continue;
+        }
+        snprintf(path, sizeof(path), JOURNAL_DIR "/%d.journal", ct->id);
+        unlink(path);
+        printf("Container %d is %s again\n", ct->id,
+               ct->unprivileged ? "unprivileged" : "privileged");
     }
     
-    return 0;
+out:
+    for (uint32_t i = 0; i < u.num_roots; i++) {
+        close(u.root_fds[i]);
+    }
+    free(u.root_fds);
+    free(u.root_devs);
+    free(u.root_containers);
+    free(u.containers);
+    free(u.entries);
+    munmap((void *)u.map, u.size);
+    return result;
 }
 
 /* Print usage */
 static void usage(const char *prog) {
-    fprintf(stderr, "Usage: %s <container_number> <privileged|unprivileged>\n", prog);
+    fprintf(stderr, "Usage: %s [options] <container_number> <privileged|unprivileged>\n", prog);
+    fprintf(stderr, "       %s [options] --batch <list> <privileged|unprivileged>\n", prog);
+    fprintf(stderr, "       %s [-y] --undo <change log>\n", prog);
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, "  -j, --jobs N   Number of walker threads (default: one per CPU)\n");
+    fprintf(stderr, "  --io-uring     Batch metadata reads through io_uring (Linux 5.6+)\n");
+    fprintf(stderr, "  --per-device N Filesystems converted at once per disk or pool (default: 1)\n");
+    fprintf(stderr, "  --batch LIST   Convert several containers, e.g. 101,102,200-250\n");
+    fprintf(stderr, "  -y, --yes      Do not ask for confirmation\n");
+    fprintf(stderr, "  --no-journal   Do not record progress for resuming in " JOURNAL_DIR "\n");
+    fprintf(stderr, "  --idempotent   Skip converted entries and report odd ones instead of stopping\n");
+    fprintf(stderr, "  --zfs-clone    Convert ZFS clones while the container runs, then swap them in\n");
+    fprintf(stderr, "  --idmap-mount  Idmap the rootfs mount where supported instead of converting it\n");
+    fprintf(stderr, "  --nested-mounts  Also convert datasets and filesystems mounted below the paths\n");
+    fprintf(stderr, "  --dry-run      Count files, links, ACLs and ids and project the run time\n");
+    fprintf(stderr, "  --stats=json   Print syscall counts, times and latency histograms as JSON\n");
+    fprintf(stderr, "  --max-rate N   Convert at most N entries per second\n");
+    fprintf(stderr, "  --max-latency MS  Slow down while metadata syscalls take longer than MS\n");
+    fprintf(stderr, "  --background   Idle I/O class and lowest CPU priority for the walker\n");
+    fprintf(stderr, "  --prefetch N   Threads reading directory metadata ahead of the walk\n");
+    fprintf(stderr, "  --max-open N   Directories kept open (default: half the fd limit)\n");
+    fprintf(stderr, "  --max-queue N  Queued directories kept in memory (default: %d)\n",
+            WALK_MAX_QUEUE);
+    fprintf(stderr, "  --verify       Check every entry is in the target range afterwards\n");
+    fprintf(stderr, "  --verify-sample=P  Check the entries of a random P%% of directories\n");
+    fprintf(stderr, "  --change-log FILE  Record every change in FILE for --undo\n");
+    fprintf(stderr, "  --undo FILE    Restore what a change log recorded\n");
     fprintf(stderr, "\nExamples:\n");
     fprintf(stderr, "  %s 111 unprivileged   # Convert container 111 to unprivileged\n", prog);
     fprintf(stderr, "  %s 111 privileged     # Convert container 111 to privileged\n", prog);
+    fprintf(stderr, "  %s --batch 101,200-250 --yes unprivileged\n", prog);
     exit(1);
 }
 
 int main(int argc, char *argv[]) {
-    char config_path[MAX_PATH_LEN];
-    char paths[MAX_PATHS][MAX_PATH_LEN];
-    int num_paths;
-    int current_unprivileged;
+    container_t *cts;
+    convert_job_t *jobs;
+    int num_cts;
+    int num_jobs = 0;
+    int num_selected = 0;
     int target_unprivileged;
     int offset;
-    int container_num;
+    int *ids;
+    int single_id;
+    id_range_t ranges[MAX_BATCH_RANGES];
+    int num_ranges;
+    const char *batch = NULL;
+    const char *change_log = NULL;
+    const char *undo = NULL;
+    int assume_yes = 0;
+    int opt;
+    static const struct option long_options[] = {
+        {"jobs",     required_argument, NULL, 'j'},
+        {"io-uring", no_argument,       NULL, 'U'},
+        {"per-device", required_argument, NULL, 'D'},
+        {"batch",    required_argument, NULL, 'B'},
+        {"yes",      no_argument,       NULL, 'y'},
+        {"no-journal", no_argument,     NULL, 'J'},
+        {"idempotent", no_argument,     NULL, 'I'},
+        {"zfs-clone", no_argument,      NULL, 'Z'},
+        {"idmap-mount", no_argument,    NULL, 'M'},
+        {"nested-mounts", no_argument,  NULL, 'E'},
+        {"dry-run",  no_argument,       NULL, 'n'},
+        {"stats",    required_argument, NULL, 'S'},
+        {"max-rate", required_argument, NULL, 'R'},
+        {"max-latency", required_argument, NULL, 'L'},
+        {"background", no_argument,     NULL, 'G'},
+        {"prefetch", required_argument, NULL, 'F'},
+        {"max-open", required_argument, NULL, 'O'},
+        {"max-queue", required_argument, NULL, 'Q'},
+        {"verify",   no_argument,       NULL, 'V'},
+        {"verify-sample", required_argument, NULL, 'P'},
+        {"change-log", required_argument, NULL, 'C'},
+        {"undo",     required_argument, NULL, 'X'},
+        {"help",     no_argument,       NULL, 'h'},
+        {NULL,       0,                 NULL, 0}
+    };
+    
+    /* Parse options */
+    while ((opt = getopt_long(argc, argv, "j:yh", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'j':
+            g_jobs = atoi(optarg);
+            if (g_jobs <= 0 || g_jobs > MAX_JOBS) {
+                fprintf(stderr, "Error: Jobs must be between 1 and %d\n", MAX_JOBS);
+                usage(argv[0]);
+            }
+            break;
+        case 'U':
+            g_io_uring = 1;
+            break;
+        case 'D':
+            g_per_device = atoi(optarg);
+            if (g_per_device <= 0) {
+                fprintf(stderr, "Error: Per-device limit must be at least 1\n");
+                usage(argv[0]);
+            }
+            break;
+        case 'B':
+            batch = optarg;
+            break;
+        case 'y':
+            assume_yes = 1;
+            break;
+        case 'J':
+            g_journal = 0;
+            break;
+        case 'I':
+            g_idempotent = 1;
+            break;
+        case 'Z':
+            g_zfs_clone = 1;
+            break;
+        case 'M':
+            g_idmap_mount = 1;
+            break;
+        case 'E':
+            g_nested = 1;
+            break;
+        case 'n':
+            g_dry_run = 1;
+            break;
+        case 'S':
+            if (strcmp(optarg, "json") != 0) {
+                fprintf(stderr, "Error: Unknown stats format %s\n", optarg);
+                usage(argv[0]);
+            }
+            g_stats = 1;
+            t_stats = &g_thread_stats[0];
+            break;
+        case 'R':
+            throttle.max_rate = strtod(optarg, NULL);
+            if (throttle.max_rate < 1) {
+                fprintf(stderr, "Error: Rate must be at least 1 entry per second\n");
+                usage(argv[0]);
+            }
+            g_throttle = 1;
+            break;
+        case 'L':
+            throttle.max_latency_ns = strtod(optarg, NULL) * 1e6;
+            if (throttle.max_latency_ns <= 0) {
+                fprintf(stderr, "Error: Latency must be a positive number of milliseconds\n");
+                usage(argv[0]);
+            }
+            g_throttle = 1;
+            break;
+        case 'G':
+            g_background = 1;
+            break;
+        case 'O':
+            g_max_open = atol(optarg);
+            if (g_max_open <= 0) {
+                fprintf(stderr, "Error: --max-open must be positive\n");
+                usage(argv[0]);
+            }
+            break;
+        case 'Q':
+            g_max_queue = atol(optarg);
+            if (g_max_queue <= 0) {
+                fprintf(stderr, "Error: --max-queue must be positive\n");
+                usage(argv[0]);
+            }
+            break;
+        case 'F':
+            g_prefetch = atoi(optarg);
+            if (g_prefetch <= 0 || g_prefetch > MAX_PREFETCH) {
+                fprintf(stderr, "Error: --prefetch must be between 1 and %d\n", MAX_PREFETCH);
+                usage(argv[0]);
+            }
+            break;
+        case 'V':
+            g_verify = 100;
+            break;
+        case 'P': {
+            char *end;
+            
+            g_verify = strtod(optarg, &end);
+            if (end == optarg || *end != '\0' || !(g_verify > 0 && g_verify <= 100)) {
+                fprintf(stderr, "Error: --verify-sample must be a percentage above 0\n");
+                usage(argv[0]);
+            }
+            break;
+        }
+        case 'C':
+            change_log = optarg;
+            break;
+        case 'X':
+            undo = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
     
     /* Check arguments */
-    if (argc != 3) {
+    if (undo) {
+        if (argc != optind || batch || change_log) {
+            usage(argv[0]);
+        }
+        return undo_changes(undo, assume_yes);
+    }
+    if (argc - optind != (batch ? 1 : 2)) {
         usage(argv[0]);
     }
-    
-    /* Parse container number */
-    container_num = atoi(argv[1]);
-    if (container_num <= 0) {
-        fprintf(stderr, "Error: Invalid container number: %s\n", argv[1]);
+    if (g_verify > 0 && g_dry_run) {
+        fprintf(stderr, "Error: --verify cannot be combined with --dry-run\n");
+        usage(argv[0]);
+    }
+    if (change_log && (g_zfs_clone || g_dry_run)) {
+        fprintf(stderr, "Error: --change-log cannot be combined with --zfs-clone or --dry-run\n");
+        usage(argv[0]);
+    }
+    if (batch && g_zfs_clone) {
+        fprintf(stderr, "Error: --zfs-clone converts one container at a time\n");
+        usage(argv[0]);
+    }
+    if (g_zfs_clone && g_idmap_mount) {
+        fprintf(stderr, "Error: --zfs-clone and --idmap-mount cannot be combined\n");
+        usage(argv[0]);
+    }
+    if (g_zfs_clone && g_nested) {
+        fprintf(stderr, "Error: --zfs-clone and --nested-mounts cannot be combined\n");
         usage(argv[0]);
     }
     
+    /* Parse container numbers */
+    if (batch) {
+        if (parse_id_list(batch, ranges, &num_ranges) == -1) {
+            usage(argv[0]);
+        }
+        ids = find_containers(ranges, num_ranges, &num_cts);
+        if (!ids) {
+            return 1;
+        }
+    } else {
+        single_id = atoi(argv[optind]);
+        if (single_id <= 0) {
+            fprintf(stderr, "Error: Invalid container number: %s\n", argv[optind]);
+            usage(argv[0]);
+        }
+        ids = &single_id;
+        num_cts = 1;
+        optind++;
+    }
+    
     /* Parse target mode */
-    if (strcmp(argv[2], "unprivileged") == 0) {
+    if (strcmp(argv[optind], "unprivileged") == 0) {
         target_unprivileged = 1;
         offset = UID_GID_OFFSET;
-    } else if (strcmp(argv[2], "privileged") == 0) {
+    } else if (strcmp(argv[optind], "privileged") == 0) {
         target_unprivileged = 0;
         offset = -UID_GID_OFFSET;
     } else {
@@ -571,92 +6383,272 @@ int main(int argc, char *argv[]) {
         usage(argv[0]);
     }
     
-    /* Check if container is running */
-    if (is_container_running(container_num)) {
-        fprintf(stderr, "Error: Container %d is currently running!\n", container_num);
-        fprintf(stderr, "Please stop the container before conversion:\n");
-        fprintf(stderr, "  pct stop %d\n", container_num);
+    cts = calloc(num_cts, sizeof(container_t));
+    if (!cts) {
+        fprintf(stderr, "Failed to allocate memory for containers\n");
         return 1;
     }
     
-    /* Construct config path */
-    snprintf(config_path, sizeof(config_path), "/etc/pve/lxc/%d.conf", container_num);
-    
-    /* Read configuration */
-    printf("Reading configuration from: %s\n", config_path);
-    if (read_config(config_path, paths, &num_paths, &current_unprivileged) == -1) {
-        return 1;
+    /* Check every container and read its config before touching anything */
+    for (int i = 0; i < num_cts; i++) {
+        container_t *ct = &cts[i];
+        int ret;
+        
+        ct->id = ids[i];
+        if (batch) {
+            printf("%s=== Container %d ===\n", i ? "\n" : "", ct->id);
+        }
+        ret = load_container(ct, target_unprivileged);
+        if (!batch && ret != 0) {
+            return ret == 1 ? 0 : 1;
+        }
+        ct->selected = ret == 0;
+        ct->failed = ret == -1;
+        num_selected += ct->selected;
+        num_jobs += ct->selected ? ct->config.num_paths : 0;
     }
-    
-    if (num_paths == 0) {
-        fprintf(stderr, "Error: No filesystems found in configuration\n");
-        return 1;
+    if (ids != &single_id) {
+        free(ids);
+    }
+    if (num_selected == 0) {
+        printf("\nNo containers to convert.\n");
+        return 0;
     }
     
-    printf("Found %d filesystem(s) to convert\n", num_paths);
-    for (int i = 0; i < num_paths; i++) {
-        printf("  [%d] %s\n", i+1, paths[i]);
+    /* Containers with lxc.idmap lines have their map printed instead */
+    if (batch || cts[0].config.idmap.num_uid + cts[0].config.idmap.num_gid == 0) {
+        printf("UID/GID offset: %+d\n", offset);
     }
     
-    /* Check current state */
-    if (current_unprivileged != -1) {
-        printf("\nCurrent state: %s\n", current_unprivileged ? "unprivileged" : "privileged");
-        printf("Target state:  %s\n", target_unprivileged ? "unprivileged" : "privileged");
+    /* Require confirmation */
+    int num_convert = 0;
+    for (int i = 0; i < num_cts; i++) {
+        num_convert += cts[i].selected && !cts[i].verify_only;
+    }
+    if (g_dry_run) {
+        printf("\nDry run: nothing will be changed.\n");
+    } else if (num_convert == 0) {
+        printf("\nVerifying only: nothing will be changed.\n");
+    } else if (batch) {
+        printf("\nWARNING: This operation will modify file ownership in %d container(s).\n",
+               num_convert);
+    } else {
+        printf("\nWARNING: This operation will modify file ownership.\n");
+    }
+    if (!assume_yes && !g_dry_run && num_convert > 0) {
+        printf("\nProceed? [y/N] ");
+        fflush(stdout);
         
-        if (current_unprivileged == target_unprivileged) {
-            printf("\nContainer is already in the target state!\n");
+        char answer[10];
+        if (!fgets(answer, sizeof(answer), stdin) || 
+            (answer[0] != 'y' && answer[0] != 'Y')) {
+            printf("Aborted.\n");
             return 0;
         }
     }
     
-    printf("UID/GID offset: %+d\n", offset);
-    
-    /* Require confirmation */
-    printf("\nWARNING: This operation will modify file ownership.\n");
-    printf("\nProceed? [y/N] ");
-    fflush(stdout);
-    
-    char answer[10];
-    if (!fgets(answer, sizeof(answer), stdin) || 
-        (answer[0] != 'y' && answer[0] != 'Y')) {
-        printf("Aborted.\n");
-        return 0;
-    }
-    
     /* Check if running as root */
     if (geteuid() != 0) {
         fprintf(stderr, "\nError: This program must be run as root\n");
         return 1;
     }
     
-    /* Convert each filesystem */
-    int overall_result = 0;
-    for (int i = 0; i < num_paths; i++) {
-        if (convert_path(paths[i], offset) == -1) {
-            fprintf(stderr, "Error converting %s\n", paths[i]);
-            overall_result = 1;
+    jobs = calloc(num_jobs, sizeof(convert_job_t));
+    if (!jobs) {
+        fprintf(stderr, "Failed to allocate memory for jobs\n");
+        return 1;
+    }
+    
+    /* One job per filesystem, all containers share the walker pool */
+    num_jobs = 0;
+    for (int i = 0; i < num_cts; i++) {
+        int in_place = (!g_zfs_clone || g_dry_run) && !cts[i].verify_only;
+        journal_t *journal = g_journal && in_place && !g_dry_run ? &cts[i].journal : NULL;
+        
+        cts[i].journal.fd = -1;
+        if (journal && cts[i].selected) {
+            if (journal_open(journal, cts[i].id, offset, &cts[i].map) == -1) {
+                cts[i].selected = 0;
+                cts[i].failed = 1;
+                cts[i].status = "journal mismatch, skipped";
+                continue;
+            }
+            if (journal->resume) {
+                printf("Resuming interrupted conversion of container %d "
+                       "(%zu directories already done)\n", cts[i].id, journal->num_done);
+            }
+        }
+        for (int k = 0; cts[i].selected && in_place && k < cts[i].config.num_paths; k++) {
+            if (k == cts[i].config.rootfs_index && cts[i].rootfs_idmap != ROOTFS_IDMAP_KEEP) {
+                continue;
+            }
+            if (job_init(&jobs[num_jobs], cts[i].config.paths[k], offset, &cts[i].map, i, journal) == -1 ||
+                (g_dry_run && census_init(&jobs[num_jobs]) == -1)) {
+                cts[i].failed = 1;
+                continue;
+            }
+            num_jobs++;
         }
     }
     
-    if (overall_result != 0) {
-        fprintf(stderr, "\nConversion completed with errors.\n");
-        fprintf(stderr, "NOT updating configuration file.\n");
-        free_inode_table();
-        return 1;
+    /* Log the containers and paths first, entries refer to them by index */
+    if (change_log) {
+        if (changelog_open(change_log) == -1) {
+            return 1;
+        }
+        for (int i = 0; i < num_cts; i++) {
+            changelog_rec_t rec;
+            
+            memset(&rec, 0, sizeof(rec));
+            rec.type = CHANGELOG_CONTAINER;
+            rec.uid = (uint32_t)cts[i].id;
+            rec.gid = (uint32_t)(cts[i].verify_only ? target_unprivileged : !target_unprivileged);
+            rec.mode = (uint32_t)cts[i].rootfs_idmap;
+            rec.path_len = (uint16_t)strlen(cts[i].config_path);
+            changelog_add(t_log, &rec, cts[i].config_path, NULL, NULL);
+        }
+        for (int i = 0; i < num_jobs; i++) {
+            changelog_rec_t rec;
+            
+            memset(&rec, 0, sizeof(rec));
+            rec.type = CHANGELOG_ROOT;
+            rec.dev = jobs[i].dev;
+            rec.root = (uint32_t)jobs[i].container;
+            rec.path_len = (uint16_t)strlen(jobs[i].path);
+            jobs[i].log_root = (uint32_t)i;
+            changelog_add(t_log, &rec, jobs[i].path, NULL, NULL);
+        }
+        if (changelog_flush(t_log) == -1) {
+            return 1;
+        }
     }
     
-    /* Update configuration file */
-    printf("\nUpdating configuration file...\n");
-    if (update_config(config_path, target_unprivileged) == -1) {
-        fprintf(stderr, "Error updating configuration file\n");
+    /* Convert all filesystems */
+    int overall_result = 0;
+    struct timespec started, finished;
+    raise_fd_limit();
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    if (g_dry_run) {
+        int threads = walker_jobs();
+        
+        convert_jobs(jobs, num_jobs);
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        for (int i = 0; i < num_jobs; i++) {
+            jobs[i].census->chown_cost = census_chown_cost(jobs[i].path);
+            census_print(&jobs[i], threads);
+        }
+        if (num_jobs > 1) {
+            printf("\nProjected conversion time for all filesystems: %.1f s\n",
+                   census_total(jobs, num_jobs, threads));
+        }
+        if (g_stats) {
+            stats_print_json(jobs, num_jobs, (finished.tv_sec - started.tv_sec) +
+                                             (finished.tv_nsec - started.tv_nsec) / 1e9);
+        }
+        for (int i = 0; i < num_jobs; i++) {
+            overall_result |= jobs[i].result != 0;
+            census_free(&jobs[i]);
+        }
+        for (int i = 0; i < num_cts; i++) {
+            config_free(&cts[i].config);
+            id_mapping_free(&cts[i].map);
+        }
+        free(cts);
+        free(jobs);
         free_inode_table();
-        return 1;
+        return overall_result;
+    } else if (g_zfs_clone && !cts[0].verify_only) {
+        cts[0].failed = zfs_clone_convert(cts[0].id, cts[0].config.paths, cts[0].config.num_paths, offset,
+                                          &cts[0].map, cts[0].running) == -1;
+    } else {
+        convert_jobs(jobs, num_jobs);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    if (change_log && changelog_close() == -1) {
+        fprintf(stderr, "\nError: the change log %s is incomplete\n", change_log);
+        for (int i = 0; i < num_cts; i++) {
+            cts[i].failed |= cts[i].selected;
+        }
+    }
+    for (int i = 0; i < num_jobs; i++) {
+        if (jobs[i].result != 0) {
+            cts[jobs[i].container].failed = 1;
+        }
+    }
+    if (g_verify > 0) {
+        verify_containers(cts, num_cts, target_unprivileged);
+    }
+    
+    for (int i = 0; i < num_cts; i++) {
+        container_t *ct = &cts[i];
+        
+        if (!ct->selected) {
+            overall_result |= ct->failed;
+            continue;
+        }
+        if (ct->verify_only) {
+            ct->status = ct->failed ? "verification failed" : "verified";
+            overall_result |= ct->failed;
+            continue;
+        }
+        if (ct->failed) {
+            fprintf(stderr, "\nContainer %d: conversion completed with errors.\n", ct->id);
+            fprintf(stderr, "NOT updating configuration file.\n");
+            if (ct->journal.fd != -1) {
+                fprintf(stderr, "Run the same conversion again to resume it.\n");
+            }
+            ct->status = "errors, config not updated";
+            journal_close(&ct->journal, 0);
+            overall_result = 1;
+            continue;
+        }
+        
+        /* Update configuration file */
+        printf("\nUpdating configuration file %s...\n", ct->config_path);
+        if (update_config(ct->config_path, &ct->config, target_unprivileged, ct->rootfs_idmap) == -1) {
+            fprintf(stderr, "Error updating configuration file\n");
+            ct->status = "config update failed";
+            ct->failed = 1;
+            journal_close(&ct->journal, 0);
+            overall_result = 1;
+            continue;
+        }
+        journal_close(&ct->journal, 1);
+        ct->status = target_unprivileged ? "now unprivileged" : "now privileged";
     }
     
-    printf("\n✓ Conversion completed successfully!\n");
-    printf("Container %d is now %s\n", container_num, 
-           target_unprivileged ? "unprivileged" : "privileged");
+    if (batch) {
+        printf("\n%-8s %5s %12s %8s  %s\n", "CTID", "FS", "FILES", "ERRORS", "STATUS");
+        for (int i = 0; i < num_cts; i++) {
+            uint64_t files = 0, errors = 0;
+            
+            for (int k = 0; k < num_jobs; k++) {
+                if (jobs[k].container == i) {
+                    files += jobs[k].files_processed;
+                    errors += jobs[k].errors;
+                }
+            }
+            printf("%-8d %5d %12"PRIu64" %8"PRIu64"  %s\n", cts[i].id,
+                   cts[i].selected ? cts[i].config.num_paths : 0, files, errors, cts[i].status);
+        }
+    } else if (overall_result == 0 && cts[0].verify_only) {
+        printf("\n✓ Verification completed successfully!\n");
+    } else if (overall_result == 0) {
+        printf("\n✓ Conversion completed successfully!\n");
+        printf("Container %d is now %s\n", cts[0].id, 
+               target_unprivileged ? "unprivileged" : "privileged");
+    }
+    if (g_stats) {
+        stats_print_json(jobs, num_jobs, (finished.tv_sec - started.tv_sec) +
+                                         (finished.tv_nsec - started.tv_nsec) / 1e9);
+    }
     
+    for (int i = 0; i < num_cts; i++) {
+        config_free(&cts[i].config);
+        id_mapping_free(&cts[i].map);
+    }
+    free(cts);
+    free(jobs);
     free_inode_table();
-    return 0;
+    return overall_result;
 }